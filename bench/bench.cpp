@@ -0,0 +1,48 @@
+#include <GLES3/gl3.h>
+#include <iostream>
+#include "../gfx/gfx.h"
+#include "main.h"
+#include "jobs.h"
+#include "bench.h"
+
+// Game hooks of the bench target: it opens a window for the GL context, runs every
+// benchmark once from gameInit and quits on the first frame. Built with `make bench`.
+
+void gameInit() {
+  createWindow(1600, 900, PROJECT_NAME " bench");
+  glViewport(0, 0, screen_w, screen_h);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  benchmarkImport(std::cout);
+  benchmarkFill(std::cout);
+  benchmarkHistory(std::cout);
+  benchmarkExpand(std::cout);
+  benchmarkTilemaps(*ImageCache::getInstance().get("data/brick.png"), 16, std::cout);
+}
+
+bool gameLoop() {
+  return false;
+}
+
+void gameUpdate() {
+}
+
+void gameCleanup() {
+  shutdownJobs();
+  ImageCache::getInstance().clear();
+}
+
+void mouse_button(bool pressed, int button, int x, int y) {
+}
+
+void mouse_wheel(int value) {
+}
+
+void mouse_move(int x, int y) {
+}
+
+void joy_button(bool pressed, int button) {
+}
+
+void key_press(bool pressed, unsigned char key, unsigned short code) {
+}
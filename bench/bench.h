@@ -0,0 +1,21 @@
+#pragma once
+#include <iosfwd>
+
+class Image;
+
+// Benchmarks of the editor's hot paths on generated data, each logs its timings to os.
+// They are built into the separate bench target only, see bench.cpp.
+
+// Fills areas of generated 4096x4096 and 8192x8192 bitmaps in every FillMode.
+void benchmarkFill(std::ostream& os);
+// Imports generated 2048x2048 images with 256 and with more colors.
+void benchmarkImport(std::ostream& os);
+// Records 1000 strokes with occasional palette changes on a 4096x4096 bitmap, then logs
+// the memory held and the time to undo and redo all of them.
+void benchmarkHistory(std::ostream& os);
+// Expands 4096x4096 random indices with the per pixel float conversion the kernel
+// replaced, a plain lookup loop and expand_indices.
+void benchmarkExpand(std::ostream& os);
+// Builds, edits and draws both tilemap kinds at several sizes. Needs a GL context and
+// draws to the current framebuffer.
+void benchmarkTilemaps(const Image& atlas, int tile_size, std::ostream& os);
@@ -0,0 +1,78 @@
+#include <chrono>
+#include <functional>
+#include <ostream>
+#include <vector>
+#include "../bitmap.h"
+#include "bench.h"
+
+void benchmarkFill(std::ostream& os) {
+    const int SIZE = 4096;
+    struct Fixture {
+        const char* name;
+        int size;
+        int x;
+        int y;
+        // index of pixel x, y
+        std::function<Pixel(int, int)> pixel;
+    };
+    const Fixture fixtures[] = {
+        {"open", SIZE, SIZE / 2, SIZE / 2, [](int, int) { return 0; }},
+        {"open", 2 * SIZE, SIZE, SIZE, [](int, int) { return 0; }},
+        // walls every 16 columns with a gap alternating between top and bottom, one winding area
+        {"serpentine", SIZE, 0, 0, [](int x, int y) {
+            bool wall = x % 16 == 15 && (((x / 16) % 2 == 0) ? y < SIZE - 2 : y >= 2);
+            return wall ? 1 : 0;
+        }},
+        // a 3x3 island walled in at 100, 100
+        {"island", SIZE, 101, 101, [](int x, int y) {
+            if (x >= 101 && x < 104 && y >= 101 && y < 104) {
+                return 2;
+            }
+            return (x >= 100 && x < 105 && y >= 100 && y < 105) ? 1 : 0;
+        }},
+    };
+    const char* modeNames[] = {"auto", "serial", "parallel"};
+    os << "Fill benchmark" << std::endl;
+    for (const Fixture& fixture : fixtures) {
+        for (int mode = 0; mode < 3; ++mode) {
+            Bitmap bitmap;
+            bitmap.reset(fixture.size, fixture.size);
+            std::vector<Pixel> row(fixture.size);
+            for (int y = 0; y < fixture.size; ++y) {
+                for (int x = 0; x < fixture.size; ++x) {
+                    row[x] = fixture.pixel(x, y);
+                }
+                bitmap.writeRow(0, y, fixture.size, row.data());
+            }
+            auto start = std::chrono::steady_clock::now();
+            Rect area = bitmap.floodFill(fixture.x, fixture.y, 3, (Bitmap::FillMode)mode);
+            std::chrono::duration<double> fillTime = std::chrono::steady_clock::now() - start;
+            os << "  " << fixture.name << " " << fixture.size << "x" << fixture.size << " " << modeNames[mode] << ": "
+               << area.width() << "x" << area.height() << " in " << fillTime.count() * 1000 << " ms" << std::endl;
+        }
+    }
+}
+
+void benchmarkImport(std::ostream& os) {
+    const unsigned SIZE = 2048;
+    os << "Import benchmark, " << SIZE << "x" << SIZE << std::endl;
+    for (int colors : {256, 4096}) {
+        // fixed pseudo random pixels picking from a fixed set of colors
+        std::vector<unsigned char> rgba((size_t)SIZE * SIZE * 4);
+        uint32_t seed = 1;
+        for (size_t i = 0; i < (size_t)SIZE * SIZE; ++i) {
+            seed = seed * 1103515245 + 12345;
+            uint32_t color = ((seed >> 8) % colors) * 2654435761u;
+            rgba[i*4 + 0] = color;
+            rgba[i*4 + 1] = color >> 8;
+            rgba[i*4 + 2] = color >> 16;
+            rgba[i*4 + 3] = 255;
+        }
+        Bitmap bitmap;
+        auto start = std::chrono::steady_clock::now();
+        bitmap.importRgba(rgba, SIZE, SIZE);
+        std::chrono::duration<double> importTime = std::chrono::steady_clock::now() - start;
+        os << "  " << colors << " colors: " << bitmap.palette.size() << " palette entries in "
+           << importTime.count() * 1000 << " ms (" << SIZE * SIZE / importTime.count() / 1e6 << " Mpixel/s)" << std::endl;
+    }
+}
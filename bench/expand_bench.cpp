@@ -0,0 +1,51 @@
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+#include "../gfx/expand.h"
+#include "bench.h"
+
+void benchmarkExpand(std::ostream& os) {
+  const size_t COUNT = 4096 * 4096;
+  std::vector<unsigned char> indices(COUNT);
+  uint32_t seed = 1;
+  for (size_t i = 0; i < COUNT; ++i) {
+    seed = seed * 1103515245 + 12345;
+    indices[i] = seed >> 16;
+  }
+  uint32_t lut[256];
+  float colors[256][3];
+  for (int i = 0; i < 256; ++i) {
+    lut[i] = 0xff000000 | (i * 0x010305);
+    colors[i][0] = (lut[i] & 0xff) / 255.0f;
+    colors[i][1] = ((lut[i] >> 8) & 0xff) / 255.0f;
+    colors[i][2] = ((lut[i] >> 16) & 0xff) / 255.0f;
+  }
+  std::vector<uint32_t> rgba(COUNT);
+  os << "Expand benchmark, " << COUNT << " indices" << std::endl;
+
+  auto start = std::chrono::steady_clock::now();
+  // the loop ImageView used before, converting the palette's float colors per pixel
+  unsigned char* bytes = (unsigned char*)rgba.data();
+  for (size_t i = 0; i < COUNT; ++i) {
+    const float* color = colors[indices[i]];
+    bytes[i*4 + 0] = color[0] * 255;
+    bytes[i*4 + 1] = color[1] * 255;
+    bytes[i*4 + 2] = color[2] * 255;
+    bytes[i*4 + 3] = 255;
+  }
+  std::chrono::duration<double> floatTime = std::chrono::steady_clock::now() - start;
+  os << "  float colors: " << floatTime.count() * 1000 << " ms" << std::endl;
+
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < COUNT; ++i) {
+    rgba[i] = lut[indices[i]];
+  }
+  std::chrono::duration<double> scalarTime = std::chrono::steady_clock::now() - start;
+  os << "  lookup loop: " << scalarTime.count() * 1000 << " ms" << std::endl;
+
+  start = std::chrono::steady_clock::now();
+  expand_indices(indices.data(), COUNT, lut, rgba.data());
+  std::chrono::duration<double> kernelTime = std::chrono::steady_clock::now() - start;
+  os << "  expand_indices: " << kernelTime.count() * 1000 << " ms" << std::endl;
+}
@@ -0,0 +1,55 @@
+#include <chrono>
+#include <ostream>
+#include <vector>
+#include "../history.h"
+#include "bench.h"
+
+void benchmarkHistory(std::ostream& os) {
+    const int SIZE = 4096;
+    const int STEPS = 1000;
+    Bitmap bitmap;
+    bitmap.reset(SIZE, SIZE);
+    for (int i = 0; i < 16; ++i) {
+        bitmap.palette.addPacked(0xff000000 | (i * 0x111111));
+    }
+    // every tile allocated, like an imported image
+    std::vector<Pixel> row(SIZE);
+    for (int y = 0; y < SIZE; ++y) {
+        for (int x = 0; x < SIZE; ++x) {
+            row[x] = (x ^ y) & 15;
+        }
+        bitmap.writeRow(0, y, SIZE, row.data());
+    }
+    History history(&bitmap, STEPS);
+    uint32_t seed = 1;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < STEPS; ++i) {
+        history.beginStep();
+        // a stroke of 30 2x2 stamps, about 60 pixels long
+        seed = seed * 1103515245 + 12345;
+        int x = (seed >> 8) % (SIZE - 64);
+        int y = (seed >> 4) % (SIZE - 64);
+        std::vector<Rect> stamps;
+        for (int j = 0; j < 30; ++j) {
+            stamps.push_back(Rect{x + j * 2, y + j, x + j * 2 + 2, y + j + 2});
+        }
+        bitmap.fillRects(stamps, i & 15);
+        if (i % 100 == 0) {
+            bitmap.palette.setPacked(i / 100, 0xff000000 | seed);
+        }
+        history.endStep();
+    }
+    std::chrono::duration<double> recordTime = std::chrono::steady_clock::now() - start;
+    os << "History benchmark, " << STEPS << " strokes on " << SIZE << "x" << SIZE << " in "
+       << recordTime.count() * 1000 << " ms" << std::endl;
+    history.report(os);
+    start = std::chrono::steady_clock::now();
+    while (history.undo()) {
+    }
+    std::chrono::duration<double> undoTime = std::chrono::steady_clock::now() - start;
+    start = std::chrono::steady_clock::now();
+    while (history.redo()) {
+    }
+    std::chrono::duration<double> redoTime = std::chrono::steady_clock::now() - start;
+    os << "  undo all " << undoTime.count() * 1000 << " ms, redo all " << redoTime.count() * 1000 << " ms" << std::endl;
+}
@@ -0,0 +1,50 @@
+#include <GLES3/gl3.h>
+#include <chrono>
+#include <ostream>
+#include "../gfx/gfx.h"
+#include "main.h"
+#include "bench.h"
+
+template<typename T>
+static void benchmarkTilemap(T& map, int size, const char* name, size_t bytes, double buildMs, std::ostream& os) {
+  const int EDITS = 1000;
+  const int FRAMES = 60;
+  const int tiles = map.getSheetTiles();
+  unsigned seed = 1;
+  auto start = std::chrono::steady_clock::now();
+  for (int i=0; i<EDITS; i++) {
+    seed = seed * 1103515245 + 12345;
+    map.setAt((seed >> 8) % size, (seed >> 4) % size, 1 + i % tiles);
+  }
+  map.drawTilemap(0, 0);
+  glFinish();
+  std::chrono::duration<double> editTime = std::chrono::steady_clock::now() - start;
+  start = std::chrono::steady_clock::now();
+  for (int i=0; i<FRAMES; i++) {
+    map.drawTilemap(-i, -i);
+  }
+  glFinish();
+  std::chrono::duration<double> drawTime = std::chrono::steady_clock::now() - start;
+  os << "  " << name << " " << size << "x" << size << ": " << bytes / 1024 << " KB, build " << buildMs << " ms, "
+     << EDITS << " edits " << editTime.count() * 1000 << " ms, draw " << drawTime.count() * 1000 / FRAMES << " ms/frame" << std::endl;
+}
+
+void benchmarkTilemaps(const Image& atlas, int tile_size, std::ostream& os) {
+  os << "Tilemap benchmark, " << tile_size << "px tiles on " << screen_w << "x" << screen_h << std::endl;
+  for (int size : {64, 256, 1024, 4096}) {
+    {
+      auto start = std::chrono::steady_clock::now();
+      Tilemap map(atlas, size, size, tile_size, tile_size);
+      glFinish();
+      std::chrono::duration<double> buildTime = std::chrono::steady_clock::now() - start;
+      benchmarkTilemap(map, size, "vertex ", map.getVertexBytes(), buildTime.count() * 1000, os);
+    }
+    {
+      auto start = std::chrono::steady_clock::now();
+      TextureTilemap map(atlas, size, size, tile_size, tile_size);
+      glFinish();
+      std::chrono::duration<double> buildTime = std::chrono::steady_clock::now() - start;
+      benchmarkTilemap(map, size, "texture", map.getTextureBytes(), buildTime.count() * 1000, os);
+    }
+  }
+}
@@ -0,0 +1,685 @@
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string_view>
+#include "bitmap.h"
+#include "parallel.h"
+
+void Bitmap::reset(unsigned int newWidth, unsigned int newHeight, Pixel fill) {
+    width = newWidth;
+    height = newHeight;
+    tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+    fillIndex = fill;
+    tiles.assign(tilesX * tilesY, nullptr);
+    tileDirty.assign(tilesX * tilesY, false);
+    dirtyTiles.clear();
+    recording = false;
+    tileRecorded.assign(tilesX * tilesY, false);
+    recordedTiles.clear();
+    markAllDirty();
+}
+
+Bitmap::Tile& Bitmap::writableTile(int tileX, int tileY) {
+    int index = tileX + tileY * tilesX;
+    std::shared_ptr<Tile>& tile = tiles[index];
+    if (recording && !tileRecorded[index]) {
+        // the recorded reference makes the tile shared, so it gets copied below
+        tileRecorded[index] = true;
+        recordedTiles.emplace_back(index, tile);
+    }
+    if (!tile) {
+        tile = std::make_shared<Tile>();
+        memset(tile->pixels, fillIndex, sizeof(tile->pixels));
+    } else if (tile.use_count() > 1) {
+        tile = std::make_shared<Tile>(*tile);
+    }
+    return *tile;
+}
+
+void Bitmap::readRow(int x, int y, int count, Pixel* out) const {
+    int tileY = y / TILE_SIZE;
+    int rowOffset = (y % TILE_SIZE) * TILE_SIZE;
+    while (count > 0) {
+        int tileX = x / TILE_SIZE;
+        int offset = x % TILE_SIZE;
+        int span = std::min(count, TILE_SIZE - offset);
+        const Tile* tile = tiles[tileX + tileY * tilesX].get();
+        if (tile) {
+            memcpy(out, tile->pixels + rowOffset + offset, span);
+        } else {
+            memset(out, fillIndex, span);
+        }
+        out += span;
+        x += span;
+        count -= span;
+    }
+}
+
+void Bitmap::writeRow(int x, int y, int count, const Pixel* in) {
+    markDirty(Rect{x, y, x + count, y + 1});
+    int tileY = y / TILE_SIZE;
+    int rowOffset = (y % TILE_SIZE) * TILE_SIZE;
+    while (count > 0) {
+        int tileX = x / TILE_SIZE;
+        int offset = x % TILE_SIZE;
+        int span = std::min(count, TILE_SIZE - offset);
+        bool onlyFill = std::all_of(in, in + span, [this](Pixel p) { return p == fillIndex; });
+        if (!onlyFill || tiles[tileX + tileY * tilesX]) {
+            memcpy(writableTile(tileX, tileY).pixels + rowOffset + offset, in, span);
+        }
+        in += span;
+        x += span;
+        count -= span;
+    }
+}
+
+Rect Bitmap::fillRects(const std::vector<Rect>& rects, Pixel index) {
+    Rect changed{0, 0, 0, 0};
+    for (const Rect& rect : rects) {
+        Rect clipped{std::max(rect.x0, 0), std::max(rect.y0, 0),
+                     std::min(rect.x1, (int)width), std::min(rect.y1, (int)height)};
+        if (clipped.isEmpty()) {
+            continue;
+        }
+        for (int y = clipped.y0; y < clipped.y1; ++y) {
+            fillSpan(clipped.x0, y, clipped.width(), index);
+        }
+        markDirty(clipped);
+        changed.unite(clipped);
+    }
+    return changed;
+}
+
+void Bitmap::fillSpan(int x, int y, int count, Pixel index) {
+    int tileY = y / TILE_SIZE;
+    int rowOffset = (y % TILE_SIZE) * TILE_SIZE;
+    while (count > 0) {
+        int offset = x % TILE_SIZE;
+        int span = std::min(count, TILE_SIZE - offset);
+        memset(writableTile(x / TILE_SIZE, tileY).pixels + rowOffset + offset, index, span);
+        x += span;
+        count -= span;
+    }
+}
+
+// Word sized compares for the long runs a fill walks over.
+static int findOther(const Pixel* pixels, int count, Pixel value) {
+    uint64_t pattern = 0x0101010101010101ull * value;
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint64_t word;
+        memcpy(&word, pixels + i, 8);
+        if (word != pattern) {
+            break;
+        }
+    }
+    while (i < count && pixels[i] == value) {
+        ++i;
+    }
+    return i;
+}
+
+int Bitmap::scanRow(int x, int end, int y, Pixel target, bool match) const {
+    int rowOffset = (y % TILE_SIZE) * TILE_SIZE;
+    int tileRow = (y / TILE_SIZE) * tilesX;
+    while (x < end) {
+        int offset = x % TILE_SIZE;
+        int span = std::min(end - x, TILE_SIZE - offset);
+        const Tile* tile = tiles[x / TILE_SIZE + tileRow].get();
+        if (!tile) {
+            if ((fillIndex == target) == match) {
+                return x;
+            }
+        } else {
+            const Pixel* pixels = tile->pixels + rowOffset + offset;
+            int found = span;
+            if (match) {
+                const void* hit = memchr(pixels, target, span);
+                if (hit) {
+                    found = (const Pixel*)hit - pixels;
+                }
+            } else {
+                found = findOther(pixels, span, target);
+            }
+            if (found < span) {
+                return x + found;
+            }
+        }
+        x += span;
+    }
+    return end;
+}
+
+// On bitmaps of at least PARALLEL_FILL_MIN pixels Auto probes with a serial fill of this
+// share of the bitmap. An area still growing after that switches to labeling when its
+// spans average PARALLEL_FILL_SPAN pixels, labeling short spans costs more than it saves.
+const size_t PARALLEL_FILL_PROBE = 64;
+const size_t PARALLEL_FILL_MIN = 1024 * 1024;
+const size_t PARALLEL_FILL_SPAN = 64;
+
+Rect Bitmap::floodFill(int x, int y, Pixel index, FillMode mode) {
+    if (!contains(x, y) || getPixel(x, y) == index) {
+        return Rect{0, 0, 0, 0};
+    }
+    Pixel target = getPixel(x, y);
+    size_t pixels = (size_t)width * height;
+    size_t budget = SIZE_MAX;
+    if (mode == FillMode::Parallel) {
+        budget = 0;
+    } else if (mode == FillMode::Auto && pixels >= PARALLEL_FILL_MIN) {
+        budget = pixels / PARALLEL_FILL_PROBE;
+    }
+    std::vector<std::pair<int, int>> stack;
+    stack.emplace_back(x, y);
+    size_t filled = 0;
+    size_t spans = 0;
+    Rect changed = floodFillSerial(stack, target, index, budget, filled, spans);
+    // seeds whose span got filled meanwhile are done
+    stack.erase(std::remove_if(stack.begin(), stack.end(), [&](const std::pair<int, int>& seed) {
+        return getPixel(seed.first, seed.second) != target;
+    }), stack.end());
+    if (stack.empty()) {
+        return changed;
+    }
+    if (mode == FillMode::Auto && filled < spans * PARALLEL_FILL_SPAN) {
+        changed.unite(floodFillSerial(stack, target, index, SIZE_MAX, filled, spans));
+        return changed;
+    }
+    Rect rest{0, 0, 0, 0};
+    if (floodFillParallel(stack, target, index, rest)) {
+        changed.unite(rest);
+    } else {
+        changed.unite(floodFillSerial(stack, target, index, SIZE_MAX, filled, spans));
+    }
+    return changed;
+}
+
+// Scanline fill: every popped seed is widened to the whole span it lies in, then one
+// seed is pushed for each run of matching pixels in the rows above and below the span.
+// Unfilled pixels of the area are always reachable from a seed left on the stack.
+Rect Bitmap::floodFillSerial(std::vector<std::pair<int, int>>& stack, Pixel target, Pixel index, size_t budget,
+                             size_t& filled, size_t& spans) {
+    Rect changed{0, 0, 0, 0};
+    while (!stack.empty() && filled < budget) {
+        auto seed = stack.back();
+        stack.pop_back();
+        int spanY = seed.second;
+        if (getPixel(seed.first, spanY) != target) {
+            continue;
+        }
+        int x0 = seed.first;
+        while (x0 > 0 && getPixel(x0 - 1, spanY) == target) {
+            --x0;
+        }
+        int x1 = scanRow(seed.first, width, spanY, target, false);
+        fillSpan(x0, spanY, x1 - x0, index);
+        filled += x1 - x0;
+        spans += 1;
+        Rect span{x0, spanY, x1, spanY + 1};
+        markDirty(span);
+        changed.unite(span);
+        for (int nextY : {spanY - 1, spanY + 1}) {
+            if (nextY < 0 || nextY >= (int)height) {
+                continue;
+            }
+            for (int runX = x0; runX < x1; ) {
+                runX = scanRow(runX, x1, nextY, target, true);
+                if (runX < x1) {
+                    stack.emplace_back(runX, nextY);
+                    runX = scanRow(runX, width, nextY, target, false);
+                }
+            }
+        }
+    }
+    return changed;
+}
+
+// Connected component labeling over runs of matching pixels. Every tile row is labeled
+// on its own with a union-find, the tile rows are then joined along their borders and
+// the runs sharing the seed's label get filled. Working in tile rows keeps the threads
+// on separate tiles when writing.
+bool Bitmap::floodFillParallel(const std::vector<std::pair<int, int>>& seeds, Pixel target, Pixel index, Rect& changed) {
+    struct Run {
+        int x0;
+        int x1;
+    };
+    struct Band {
+        std::vector<Run> runs;
+        std::vector<int> rowStart; // first run of each row, plus the end
+        std::vector<int> parent;
+        int offset = 0;
+    };
+    // very fragmented images would need more memory for the runs than the bitmap has
+    size_t maxRuns = (size_t)width * TILE_SIZE / 16;
+    std::vector<Band> bands(tilesY);
+    std::atomic<bool> overflow{false};
+    auto find = [](std::vector<int>& parent, int i) {
+        while (parent[i] != i) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    };
+    parallelBands(tilesY, [&](int begin, int end) {
+        for (int tileY = begin; tileY < end && !overflow; ++tileY) {
+            Band& band = bands[tileY];
+            int y0 = tileY * TILE_SIZE;
+            int y1 = std::min(y0 + TILE_SIZE, (int)height);
+            for (int rowY = y0; rowY < y1; ++rowY) {
+                band.rowStart.push_back(band.runs.size());
+                for (int runX = scanRow(0, width, rowY, target, true); runX < (int)width; ) {
+                    int runEnd = scanRow(runX, width, rowY, target, false);
+                    band.runs.push_back(Run{runX, runEnd});
+                    runX = scanRow(runEnd, width, rowY, target, true);
+                }
+                if (band.runs.size() > maxRuns) {
+                    overflow = true;
+                    return;
+                }
+            }
+            band.rowStart.push_back(band.runs.size());
+            band.parent.resize(band.runs.size());
+            for (size_t i = 0; i < band.parent.size(); ++i) {
+                band.parent[i] = i;
+            }
+            for (int row = 1; row < y1 - y0; ++row) {
+                // runs of both rows are sorted, so overlapping pairs are found in one pass
+                int above = band.rowStart[row - 1];
+                int below = band.rowStart[row];
+                while (above < band.rowStart[row] && below < band.rowStart[row + 1]) {
+                    const Run& a = band.runs[above];
+                    const Run& b = band.runs[below];
+                    if (a.x0 < b.x1 && b.x0 < a.x1) {
+                        band.parent[find(band.parent, above)] = find(band.parent, below);
+                    }
+                    if (a.x1 < b.x1) {
+                        ++above;
+                    } else {
+                        ++below;
+                    }
+                }
+            }
+        }
+    }, 1);
+    if (overflow) {
+        return false;
+    }
+
+    std::vector<int> parent;
+    for (Band& band : bands) {
+        band.offset = parent.size();
+        for (int p : band.parent) {
+            parent.push_back(p + band.offset);
+        }
+    }
+    for (int tileY = 1; tileY < tilesY; ++tileY) {
+        const Band& upper = bands[tileY - 1];
+        const Band& lower = bands[tileY];
+        int above = upper.rowStart[TILE_SIZE - 1];
+        int below = 0;
+        while (above < upper.rowStart[TILE_SIZE] && below < lower.rowStart[1]) {
+            const Run& a = upper.runs[above];
+            const Run& b = lower.runs[below];
+            if (a.x0 < b.x1 && b.x0 < a.x1) {
+                parent[find(parent, above + upper.offset)] = find(parent, below + lower.offset);
+            }
+            if (a.x1 < b.x1) {
+                ++above;
+            } else {
+                ++below;
+            }
+        }
+    }
+    // resolve every label up front so the threads below only read
+    for (size_t i = 0; i < parent.size(); ++i) {
+        parent[i] = find(parent, i);
+    }
+    std::vector<char> fillRoot(parent.size(), 0);
+    for (const auto& seed : seeds) {
+        int x = seed.first;
+        int y = seed.second;
+        if (getPixel(x, y) != target) {
+            continue;
+        }
+        const Band& seedBand = bands[y / TILE_SIZE];
+        int seedRun = seedBand.rowStart[y % TILE_SIZE];
+        while (seedBand.runs[seedRun].x1 <= x) {
+            ++seedRun;
+        }
+        fillRoot[parent[seedRun + seedBand.offset]] = 1;
+    }
+
+    // tiles are made writable on this thread, undo recording and copying are not thread safe
+    std::vector<Rect> bandChanged(tilesY, Rect{0, 0, 0, 0});
+    std::vector<char> touched(tiles.size(), 0);
+    parallelBands(tilesY, [&](int begin, int end) {
+        for (int tileY = begin; tileY < end; ++tileY) {
+            const Band& band = bands[tileY];
+            for (int row = 0; row + 1 < (int)band.rowStart.size(); ++row) {
+                for (int i = band.rowStart[row]; i < band.rowStart[row + 1]; ++i) {
+                    if (!fillRoot[parent[i + band.offset]]) {
+                        continue;
+                    }
+                    const Run& run = band.runs[i];
+                    int rowY = tileY * TILE_SIZE + row;
+                    bandChanged[tileY].unite(Rect{run.x0, rowY, run.x1, rowY + 1});
+                    for (int tileX = run.x0 / TILE_SIZE; tileX <= (run.x1 - 1) / TILE_SIZE; ++tileX) {
+                        touched[tileX + tileY * tilesX] = 1;
+                    }
+                }
+            }
+        }
+    }, 1);
+    for (int i = 0; i < (int)tiles.size(); ++i) {
+        if (touched[i]) {
+            writableTile(i % tilesX, i / tilesX);
+            markDirty(tileRect(i));
+        }
+    }
+    parallelBands(tilesY, [&](int begin, int end) {
+        for (int tileY = begin; tileY < end; ++tileY) {
+            const Band& band = bands[tileY];
+            for (int row = 0; row + 1 < (int)band.rowStart.size(); ++row) {
+                int rowOffset = row * TILE_SIZE;
+                for (int i = band.rowStart[row]; i < band.rowStart[row + 1]; ++i) {
+                    if (!fillRoot[parent[i + band.offset]]) {
+                        continue;
+                    }
+                    for (int runX = band.runs[i].x0; runX < band.runs[i].x1; ) {
+                        int offset = runX % TILE_SIZE;
+                        int span = std::min(band.runs[i].x1 - runX, TILE_SIZE - offset);
+                        memset(tiles[runX / TILE_SIZE + tileY * tilesX]->pixels + rowOffset + offset, index, span);
+                        runX += span;
+                    }
+                }
+            }
+        }
+    }, 1);
+    changed = Rect{0, 0, 0, 0};
+    for (const Rect& rect : bandChanged) {
+        changed.unite(rect);
+    }
+    return true;
+}
+
+void Bitmap::assign(unsigned int newWidth, unsigned int newHeight, const std::vector<Pixel>& pixels) {
+    reset(newWidth, newHeight, fillIndex);
+    for (unsigned int y = 0; y < height; ++y) {
+        writeRow(0, y, width, pixels.data() + (size_t)y * width);
+    }
+}
+
+void Bitmap::markDirty(const Rect& rect) {
+    int x0 = std::max(rect.x0, 0) / TILE_SIZE;
+    int y0 = std::max(rect.y0, 0) / TILE_SIZE;
+    int x1 = std::min((rect.x1 + TILE_SIZE - 1) / TILE_SIZE, tilesX);
+    int y1 = std::min((rect.y1 + TILE_SIZE - 1) / TILE_SIZE, tilesY);
+    for (int tileY = y0; tileY < y1; ++tileY) {
+        for (int tileX = x0; tileX < x1; ++tileX) {
+            int index = tileX + tileY * tilesX;
+            if (!tileDirty[index]) {
+                tileDirty[index] = true;
+                dirtyTiles.push_back(index);
+            }
+        }
+    }
+}
+
+std::vector<int> Bitmap::takeDirtyTiles() {
+    std::vector<int> result;
+    result.swap(dirtyTiles);
+    for (int index : result) {
+        tileDirty[index] = false;
+    }
+    return result;
+}
+
+Rect Bitmap::tileRect(int tileIndex) const {
+    int x = (tileIndex % tilesX) * TILE_SIZE;
+    int y = (tileIndex / tilesX) * TILE_SIZE;
+    return Rect{x, y, std::min(x + TILE_SIZE, (int)width), std::min(y + TILE_SIZE, (int)height)};
+}
+
+void Bitmap::beginRecording() {
+    endRecording();
+    recording = true;
+}
+
+Bitmap::TileList Bitmap::endRecording() {
+    TileList result;
+    result.swap(recordedTiles);
+    for (auto& entry : result) {
+        tileRecorded[entry.first] = false;
+    }
+    recording = false;
+    return result;
+}
+
+void Bitmap::swapTile(int tileIndex, std::shared_ptr<Tile>& tile) {
+    tiles[tileIndex].swap(tile);
+    markDirty(tileRect(tileIndex));
+}
+
+size_t Bitmap::getAllocatedTiles() const {
+    return std::count_if(tiles.begin(), tiles.end(), [](const std::shared_ptr<Tile>& tile) { return tile != nullptr; });
+}
+
+unsigned int Bitmap::loadpng(const std::string& filename, int maxColors, Dither dither) {
+    std::vector<unsigned char> png;
+    lodepng::load_file(png, filename);
+    lodepng::State state;
+    unsigned newWidth = 0;
+    unsigned newHeight = 0;
+    unsigned error = lodepng_inspect(&newWidth, &newHeight, &state, png.data(), png.size());
+    if (error == 0 && state.info_png.color.colortype == LCT_PALETTE) {
+        return loadIndexedPng(filename, png, state);
+    }
+    std::vector<unsigned char> image;
+    if (error == 0) {
+        error = lodepng::decode(image, newWidth, newHeight, png);
+    }
+    if(error != 0)
+    {
+        std::cout << "error " << error << ": " << lodepng_error_text(error) << std::endl;
+        return 1;
+    }
+    importRgba(image, newWidth, newHeight, maxColors, dither);
+    return 0;
+}
+
+void Bitmap::importRgba(const std::vector<unsigned char>& image, unsigned int newWidth, unsigned int newHeight,
+                        int maxColors, Dither dither) {
+    std::vector<Pixel> data((size_t)newWidth * newHeight);
+    // indices have to fit in a Pixel, on overflow the image gets quantized instead;
+    // either way the image brings its own palette
+    maxColors = std::min(maxColors, 256);
+    palette.setSize(0);
+    bool overflow = false;
+    for(size_t i = 0; i < data.size(); i++) {
+        uint32_t color = image[i*4 + 0] | (image[i*4 + 1] << 8) | (image[i*4 + 2] << 16) | ((uint32_t)image[i*4 + 3] << 24);
+        auto index = palette.addPacked(color);
+        if (palette.size() > (size_t)maxColors) {
+            overflow = true;
+            break;
+        }
+        data[i] = index;
+    }
+    if (overflow) {
+        std::vector<uint32_t> colors;
+        quantize_image(image.data(), newWidth, newHeight, maxColors, dither, colors, data.data());
+        palette.setSize(colors.size());
+        for (size_t i = 0; i < colors.size(); ++i) {
+            palette.setPacked(i, colors[i]);
+        }
+    }
+    assign(newWidth, newHeight, data);
+}
+
+// Palette PNGs are taken as they are: indices go straight into data and the PLTE
+// entries replace the palette, keeping the order from the file.
+unsigned int Bitmap::loadIndexedPng(const std::string& filename, const std::vector<unsigned char>& png, lodepng::State& state) {
+    std::vector<unsigned char> raw;
+    unsigned newWidth = 0;
+    unsigned newHeight = 0;
+    state.decoder.color_convert = 0;
+    unsigned error = lodepng::decode(raw, newWidth, newHeight, state, png);
+    if(error != 0)
+    {
+        std::cout << "error " << error << ": " << lodepng_error_text(error) << std::endl;
+        return 1;
+    }
+    const LodePNGColorMode& mode = state.info_png.color;
+    palette.setSize(mode.palettesize);
+    for (size_t i = 0; i < mode.palettesize; ++i) {
+        const unsigned char* entry = mode.palette + i*4;
+        palette.setPacked(i, entry[0] | (entry[1] << 8) | (entry[2] << 16) | ((uint32_t)entry[3] << 24));
+    }
+    const unsigned bits = mode.bitdepth;
+    const size_t count = (size_t)newWidth * newHeight;
+    std::vector<Pixel> data(count);
+    if (bits == 8) {
+        std::copy(raw.begin(), raw.begin() + count, data.begin());
+    } else {
+        // lodepng packs sub-byte pixels without per scanline padding, most significant bits first
+        const unsigned mask = (1 << bits) - 1;
+        for (size_t i = 0; i < count; ++i) {
+            size_t bit = i * bits;
+            data[i] = (raw[bit >> 3] >> (8 - bits - (bit & 7))) & mask;
+        }
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (data[i] >= mode.palettesize) {
+            data[i] = 0;
+        }
+    }
+    assign(newWidth, newHeight, data);
+    return 0;
+}
+
+
+// Reads the whole file at once and parses it in place. Pixel codes are resolved with a
+// direct table when they are at most two characters, with a hash of views into the
+// buffer otherwise.
+unsigned int Bitmap::loadXpm2(const std::string& filename)
+{
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    if (!file) {
+        std::cout << "could not open " << filename << std::endl;
+        return 1;
+    }
+    file.seekg(0, std::ios::end);
+    std::string text(file.tellg(), '\0');
+    file.seekg(0, std::ios::beg);
+    file.read(&text[0], text.size());
+    file.close();
+
+    const char* pos = text.data();
+    const char* end = pos + text.size();
+    auto nextLine = [&]() {
+        const char* begin = pos;
+        const char* lineEnd = std::find(pos, end, '\n');
+        pos = lineEnd == end ? end : lineEnd + 1;
+        if (lineEnd > begin && lineEnd[-1] == '\r') {
+            --lineEnd;
+        }
+        return std::string_view(begin, lineEnd - begin);
+    };
+    auto nextWord = [](std::string_view& line) {
+        size_t begin = line.find_first_not_of(" \t");
+        if (begin == std::string_view::npos) {
+            line = std::string_view();
+            return std::string_view();
+        }
+        size_t wordEnd = std::min(line.find_first_of(" \t", begin), line.size());
+        std::string_view word = line.substr(begin, wordEnd - begin);
+        line.remove_prefix(wordEnd);
+        return word;
+    };
+
+    if (nextLine() != "! XPM2") {
+        std::cout << "not xpm2" << std::endl;
+        return 1;
+    }
+    std::string header(nextLine());
+    unsigned int newWidth = 0;
+    unsigned int newHeight = 0;
+    int colors = 0;
+    int cpp = 0; // characters per pixel
+    if (sscanf(header.c_str(), "%u %u %d %d", &newWidth, &newHeight, &colors, &cpp) != 4
+            || newWidth == 0 || newHeight == 0 || cpp < 1 || colors < 1) {
+        std::cout << "bad xpm2 header: " << header << std::endl;
+        return 1;
+    }
+    if (colors > 256) {
+        std::cout << "xpm2 with " << colors << " colors does not fit the palette" << std::endl;
+        return 1;
+    }
+
+    // codes of up to two characters index this table directly
+    std::vector<int16_t> shortCodes(cpp <= 2 ? 1 << (8 * cpp) : 0, -1);
+    std::unordered_map<std::string_view, int> longCodes;
+    auto shortKey = [cpp](const char* code) {
+        return cpp == 1 ? (uint8_t)code[0] : ((uint8_t)code[0] << 8) | (uint8_t)code[1];
+    };
+    std::vector<Color> newColors(colors, Color{0, 0, 0});
+    for (int i = 0; i < colors; ++i) {
+        std::string_view line = nextLine();
+        if ((int)line.size() < cpp) {
+            std::cout << "bad xpm2 color line " << i << std::endl;
+            return 1;
+        }
+        std::string_view code = line.substr(0, cpp);
+        line.remove_prefix(cpp);
+        if (cpp <= 2) {
+            shortCodes[shortKey(code.data())] = i;
+        } else {
+            longCodes.emplace(code, i);
+        }
+        // key/value pairs, only the color visual ("c") is used
+        std::string_view value;
+        while (!line.empty()) {
+            std::string_view key = nextWord(line);
+            std::string_view word = nextWord(line);
+            if (key == "c" || value.empty()) {
+                value = word;
+            }
+        }
+        if (value.size() == 7 && value[0] == '#') {
+            newColors[i] = Color::fromHex(std::string(value));
+        } else if (value == "None") {
+            newColors[i] = Color{0, 0, 0, 0};
+        }
+    }
+
+    const size_t pixelCount = (size_t)newWidth * newHeight;
+    std::vector<Pixel> newData(pixelCount, 0);
+    size_t dataIndex = 0;
+    while (pos < end && dataIndex < pixelCount) {
+        std::string_view line = nextLine();
+        const char* code = line.data();
+        const char* lineEnd = code + std::min(line.size() / cpp, (size_t)newWidth) * cpp;
+        for (; code < lineEnd && dataIndex < pixelCount; code += cpp) {
+            int paletteIndex;
+            if (cpp <= 2) {
+                paletteIndex = shortCodes[shortKey(code)];
+            } else {
+                auto codeIt = longCodes.find(std::string_view(code, cpp));
+                paletteIndex = codeIt != longCodes.end() ? codeIt->second : -1;
+            }
+            newData[dataIndex] = paletteIndex < 0 ? 0 : paletteIndex;
+            dataIndex += 1;
+        }
+    }
+
+    assign(newWidth, newHeight, newData);
+    palette.setSize(colors);
+    for (int i = 0; i < colors; ++i) {
+        palette.setColor(i, newColors[i]);
+    }
+    return 0;
+}
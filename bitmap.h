@@ -0,0 +1,267 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "gfx/lodepng.h"
+#include "gfx/quantize.h"
+
+typedef uint8_t Pixel;
+
+struct Color {
+    float r;
+    float g;
+    float b;
+    float a = 1.0f;
+    static Color fromHex(const std::string& hexString) {
+        float r = stoi(hexString.substr(1, 2), nullptr, 16) / 255.0;
+        float g = stoi(hexString.substr(3, 2), nullptr, 16) / 255.0;
+        float b = stoi(hexString.substr(5, 2), nullptr, 16) / 255.0;
+        return Color{r, g, b};
+    }
+    static Color unpack(uint32_t packed) {
+        return Color{
+            (packed & 0xff) / 255.0f,
+            ((packed >> 8) & 0xff) / 255.0f,
+            ((packed >> 16) & 0xff) / 255.0f,
+            (packed >> 24) / 255.0f,
+        };
+    }
+    // colors are equal when they are at 8 bits per channel
+    bool operator==(const Color& other) const { return pack() == other.pack(); }
+    // RGBA8 packed as 0xAABBGGRR (byte order R, G, B, A in memory on little endian)
+    uint32_t pack() const {
+        return toByte(r) | (toByte(g) << 8) | (toByte(b) << 16) | (toByte(a) << 24);
+    }
+    static uint32_t toByte(float value) {
+        return std::min(std::max(value, 0.0f), 1.0f) * 255.0f + 0.5f;
+    }
+};
+
+// Colors are kept packed as RGBA8 (see Color::pack); comparisons, the color index and
+// the textures work on that, the float view for drawing is derived from it. Every
+// change gives the palette a new version, so equal versions mean equal contents, also
+// between copies.
+class Palette {
+    public:
+        Palette() {
+            touch();
+        }
+        size_t size() const { return packed.size(); }
+        void setSize(int newSize) {
+            packed.resize(newSize, 0xff000000);
+            colors.resize(newSize, Color{0, 0, 0});
+            rebuildIndex();
+            touch();
+        }
+        Color getColor(Pixel index) const { return colors[index]; }
+        uint32_t getPacked(Pixel index) const { return packed[index]; }
+        const Color* getColors() const { return colors.data(); }
+        const uint32_t* getPackedColors() const { return packed.data(); }
+        uint64_t getVersion() const { return version; }
+        // Fills 256 entries with the packed colors, unused entries are 0.
+        void packLut(uint32_t* out) const {
+            std::copy(packed.begin(), packed.end(), out);
+            std::fill(out + packed.size(), out + 256, 0);
+        }
+        bool operator==(const Palette& other) const { return version == other.version || packed == other.packed; }
+        bool operator!=(const Palette& other) const { return !(*this == other); }
+        void setColor(Pixel index, Color color) { setPacked(index, color.pack()); }
+        void setPacked(Pixel index, uint32_t color) {
+            if (packed[index] == color) {
+                return;
+            }
+            unindex(index);
+            packed[index] = color;
+            colors[index] = Color::unpack(color);
+            addToIndex(color, index);
+            touch();
+        }
+        // Returns the first entry matching the color, appending it if there is none.
+        Pixel addColor(Color color) { return addPacked(color.pack()); }
+        Pixel addPacked(uint32_t color) {
+            auto it = colorIndex.find(color);
+            if (it != colorIndex.end()) {
+                return it->second;
+            }
+            packed.push_back(color);
+            colors.push_back(Color::unpack(color));
+            colorIndex.emplace(color, packed.size() - 1);
+            touch();
+            return packed.size() - 1;
+        }
+    private:
+        void touch() {
+            static std::atomic<uint64_t> lastVersion{0};
+            version = ++lastVersion;
+        }
+        void rebuildIndex() {
+            colorIndex.clear();
+            for (size_t i = 0; i < packed.size(); ++i) {
+                colorIndex.emplace(packed[i], i);
+            }
+        }
+        // The index keeps the lowest entry for every color, like a linear search would find it.
+        void addToIndex(uint32_t key, size_t position) {
+            auto it = colorIndex.find(key);
+            if (it == colorIndex.end()) {
+                colorIndex.emplace(key, position);
+            } else if (it->second > position) {
+                it->second = position;
+            }
+        }
+        void unindex(size_t position) {
+            uint32_t key = packed[position];
+            auto it = colorIndex.find(key);
+            if (it == colorIndex.end() || it->second != position) {
+                return;
+            }
+            colorIndex.erase(it);
+            // another entry may hold the same color
+            for (size_t i = position + 1; i < packed.size(); ++i) {
+                if (packed[i] == key) {
+                    colorIndex.emplace(key, i);
+                    break;
+                }
+            }
+        }
+        std::vector<uint32_t> packed;
+        std::vector<Color> colors;
+        std::unordered_map<uint32_t, size_t> colorIndex;
+        uint64_t version = 0;
+};
+
+struct Rect {
+    int x0;
+    int y0;
+    int x1; // exclusive
+    int y1; // exclusive
+    int width() const { return x1 - x0; }
+    int height() const { return y1 - y0; }
+    bool isEmpty() const { return x1 <= x0 || y1 <= y0; }
+    void unite(const Rect& other) {
+        if (other.isEmpty()) {
+            return;
+        }
+        if (isEmpty()) {
+            *this = other;
+            return;
+        }
+        x0 = std::min(x0, other.x0);
+        y0 = std::min(y0, other.y0);
+        x1 = std::max(x1, other.x1);
+        y1 = std::max(y1, other.y1);
+    }
+};
+
+// Pixels are stored in TILE_SIZE x TILE_SIZE tiles that are allocated on first write;
+// a missing tile reads as the fill index everywhere. Tiles are shared pointers so that
+// copies of the tile list can share them, a shared tile is copied before being written.
+class Bitmap {
+    public:
+        static const int TILE_SIZE = 64;
+        struct Tile {
+            Pixel pixels[TILE_SIZE * TILE_SIZE];
+        };
+
+        Bitmap() {
+            reset(1, 1, 0);
+        }
+        // Drops all content, every pixel reads as fill afterwards.
+        void reset(unsigned int newWidth, unsigned int newHeight, Pixel fill = 0);
+        Pixel getPixel(int x, int y) const {
+            const Tile* tile = tiles[(x / TILE_SIZE) + (y / TILE_SIZE) * tilesX].get();
+            return tile ? tile->pixels[(x % TILE_SIZE) + (y % TILE_SIZE) * TILE_SIZE] : fillIndex;
+        }
+        bool contains(int x, int y) const {
+            return x >= 0 && y >= 0 && x < (int)width && y < (int)height;
+        }
+        void setPixel(int x, int y, Pixel index) {
+            Tile& tile = writableTile(x / TILE_SIZE, y / TILE_SIZE);
+            tile.pixels[(x % TILE_SIZE) + (y % TILE_SIZE) * TILE_SIZE] = index;
+            markDirty(Rect{x, y, x + 1, y + 1});
+        }
+        // Copies count pixels of row y starting at x, the span has to be inside the bitmap.
+        void readRow(int x, int y, int count, Pixel* out) const;
+        // Writes a span without touching tiles that would only receive the fill index.
+        void writeRow(int x, int y, int count, const Pixel* in);
+        // Fills all rects with one index, clipped to the bitmap. Returns the union of the
+        // clipped rects.
+        Rect fillRects(const std::vector<Rect>& rects, Pixel index);
+        // The serial mode only visits the filled area, the parallel mode labels the whole
+        // bitmap in bands, which only pays off for areas covering much of a large bitmap.
+        // Auto starts serial and hands the rest to the parallel mode early when the area
+        // turns out large and made of long spans.
+        enum class FillMode { Auto, Serial, Parallel };
+        // Replaces the 4-connected area of pixels equal to the one at x, y with index and
+        // returns its bounds.
+        Rect floodFill(int x, int y, Pixel index, FillMode mode = FillMode::Auto);
+        // Replaces size and content with a row-major width x height buffer.
+        void assign(unsigned int newWidth, unsigned int newHeight, const std::vector<Pixel>& pixels);
+
+        // Dirty state is kept per tile.
+        void markDirty(const Rect& rect);
+        void markAllDirty() { markDirty(Rect{0, 0, (int)width, (int)height}); }
+        // Returns the tiles changed since the previous call and resets them.
+        std::vector<int> takeDirtyTiles();
+        bool hasDirtyTiles() const { return !dirtyTiles.empty(); }
+        // Area covered by a tile, clipped to the bitmap.
+        Rect tileRect(int tileIndex) const;
+        // Null when the tile is not allocated.
+        const Tile* getTile(int tileIndex) const { return tiles[tileIndex].get(); }
+        int getTilesX() const { return tilesX; }
+        int getTilesY() const { return tilesY; }
+        size_t getAllocatedTiles() const;
+
+        // While recording, the first write to a tile keeps the tile as it was before.
+        // endRecording hands those over as (tile index, previous tile) pairs.
+        typedef std::vector<std::pair<int, std::shared_ptr<Tile>>> TileList;
+        void beginRecording();
+        TileList endRecording();
+        bool isRecording() const { return recording; }
+        // Exchanges a tile with the given one and marks it dirty.
+        void swapTile(int tileIndex, std::shared_ptr<Tile>& tile);
+        Pixel getFillIndex() const { return fillIndex; }
+
+        int getWidth() const { return width; }
+        int getHeight() const { return height; }
+        // Truecolor images with more than maxColors colors are quantized on import.
+        unsigned int loadpng(const std::string& filename, int maxColors = 256, Dither dither = Dither::FloydSteinberg);
+        // Replaces the bitmap with a row-major RGBA8 image, like loadpng does after decoding.
+        void importRgba(const std::vector<unsigned char>& rgba, unsigned int newWidth, unsigned int newHeight,
+                        int maxColors = 256, Dither dither = Dither::FloydSteinberg);
+        unsigned int loadXpm2(const std::string& filename);
+
+        Palette palette;
+    private:
+        unsigned int loadIndexedPng(const std::string& filename, const std::vector<unsigned char>& png, lodepng::State& state);
+        // Allocates a missing tile and unshares a shared one.
+        Tile& writableTile(int tileX, int tileY);
+        // Span writes without dirty tracking.
+        void fillSpan(int x, int y, int count, Pixel index);
+        // First x in [x, end) whose pixel equals target (match) or differs from it, end if none.
+        int scanRow(int x, int end, int y, Pixel target, bool match) const;
+        // Fills from the seeds on the stack until filled is at least budget, the seeds not
+        // processed yet are left on the stack. Adds the pixels and spans filled to the counts.
+        Rect floodFillSerial(std::vector<std::pair<int, int>>& stack, Pixel target, Pixel index, size_t budget,
+                             size_t& filled, size_t& spans);
+        // Fills the areas containing any of the seeds. Returns false when the bitmap has too
+        // many runs to label, nothing is written then.
+        bool floodFillParallel(const std::vector<std::pair<int, int>>& seeds, Pixel target, Pixel index, Rect& changed);
+        // Null for tiles never written. The table alone is one shared_ptr (16 bytes) per
+        // tile, 4 MB for 32k x 32k; allocated tiles add their pixels and control block.
+        std::vector<std::shared_ptr<Tile>> tiles;
+        std::vector<bool> tileDirty;
+        std::vector<int> dirtyTiles;
+        bool recording = false;
+        std::vector<bool> tileRecorded;
+        TileList recordedTiles;
+        unsigned int width = 0;
+        unsigned int height = 0;
+        int tilesX = 0;
+        int tilesY = 0;
+        Pixel fillIndex = 0;
+};
@@ -32,42 +32,137 @@ class Canvas {
         prim.setScroll(currentScroll.x, currentScroll.y);
     }
     void setScale(float scale) { prim.setScale(scale); }
-    void drawLine(float x0, float y0, float x1, float y1) { prim.drawLine(x0, y0, x1, y1); }
-    void drawRectangle(float x0, float y0, float x1, float y1) { prim.drawRectangle(x0, y0, x1, y1); }
-    void drawTexture(float x0, float y0, float w, float h, float targetW, float targetH) { prim.drawTexture(x0, y0, w, h, targetW, targetH); }
+    void setTexture(GLuint texture) { prim.setTexture(texture); }
+    void setPaletteTexture(GLuint texture) { prim.setPaletteTexture(texture); }
+    // clip rect relative to the current scroll
+    void setClip(int x, int y, int w, int h) {
+      sprites.flush();
+      clip = Clip{true, (int)(x + currentScroll.x), (int)(y + currentScroll.y), w, h};
+      prim.setClip(clip.x, clip.y, clip.w, clip.h);
+    }
+    void clearClip() {
+      sprites.flush();
+      clip.enabled = false;
+      prim.clearClip();
+    }
+    // draws everything batched so far, needed before issuing GL calls that bypass the Canvas
+    void flush() {
+      prim.flush();
+      sprites.flush();
+    }
+    // Redirects drawing to a cleared target until endTarget. Colors are stored
+    // premultiplied by alpha so drawTarget can blend them like drawing directly would.
+    // Targets nest, endTarget goes back to the target and clip active before.
+    void beginTarget(const RenderTarget& target) {
+      flush();
+      targetStack.push_back(TargetState{currentTarget, clip});
+      currentTarget = &target;
+      clip.enabled = false;
+      prim.clearClip();
+      bindTarget();
+      GLfloat clearColor[4];
+      glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+      glClearColor(0.0, 0.0, 0.0, 0.0);
+      glClear(GL_COLOR_BUFFER_BIT);
+      glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+    }
+    void endTarget() {
+      flush();
+      currentTarget = targetStack.back().target;
+      clip = targetStack.back().clip;
+      targetStack.pop_back();
+      bindTarget();
+      if (clip.enabled) {
+        prim.setClip(clip.x, clip.y, clip.w, clip.h);
+      } else {
+        prim.clearClip();
+      }
+    }
+    // Draws the content of a target with its top left corner at x, y.
+    void drawTarget(const RenderTarget& target, int x, int y) {
+      flush();
+      glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+      prim.setTexture(target.getTexture());
+      prim.drawFlippedTexture(x, y, target.getWidth(), target.getHeight());
+      prim.flush();
+      setBlending();
+    }
+    // Call after the last drawing of a frame, releases cached text drawn longest ago.
+    void endFrame() {
+      prim.flush();
+      sprites.endFrame();
+    }
+    void drawLine(float x0, float y0, float x1, float y1) { primitives().drawLine(x0, y0, x1, y1); }
+    void drawRectangle(float x0, float y0, float x1, float y1) { primitives().drawRectangle(x0, y0, x1, y1); }
+    void drawTexture(float x0, float y0, float w, float h) { primitives().drawTexture(x0, y0, w, h); }
+    void drawPaletteTexture(float x0, float y0, float w, float h) { primitives().drawPaletteTexture(x0, y0, w, h); }
     void drawConvexPolygon(const std::vector<float>& points, float textureScale, float texture_x, float texture_y) {
-      prim.drawConvexPolygon(points, textureScale, texture_x, texture_y);
+      primitives().drawConvexPolygon(points, textureScale, texture_x, texture_y);
     }
-    void drawCircle(float x, float y, float r) { prim.drawCircle(x, y, r); }
-    void drawCircleOutline(float x, float y, float r) { prim.drawCircleOutline(x, y, r); }
+    void drawCircle(float x, float y, float r) { primitives().drawCircle(x, y, r); }
+    void drawCircleOutline(float x, float y, float r) { primitives().drawCircleOutline(x, y, r); }
+    void drawGrid(float x0, float y0, float cellW, float cellH, int columns, int rows) { primitives().drawGrid(x0, y0, cellW, cellH, columns, rows); }
     void print(const Point& start_pos, const std::string& text, float size=1.0) {
       int x = start_pos.x - 8 + currentScroll.x;
       int y = start_pos.y - 8 + currentScroll.y;
-      const float kern = 0.8;
-      for (char c: text) {
-        if (c == '\n') {
-          x = start_pos.x - 8;
-          y += 20;
-        }
-        else {
-          fontSheet.drawSpriteScaled(x, y, c, size);
-          x += fontSheet.getFrameWidth() * kern * size;
-        }
-      }
+      prim.flush();
+      sprites.drawText(fontSheet, x, y, text, size);
     }
     void draw(Image& image, Point position, float scale = 1.0) {
+      prim.flush();
       image.draw(position.x, position.y, image.getWidth() * scale, image.getHeight() * scale);
     }
     void draw(Image& image, Point position, Point size) {
+      prim.flush();
       image.draw(position.x, position.y, size.x, size.y);
     }
 
   private:
+    struct Clip {
+      bool enabled;
+      int x;
+      int y;
+      int w;
+      int h;
+    };
+    struct TargetState {
+      const RenderTarget* target;
+      Clip clip;
+    };
+    // Binds currentTarget, or the screen when there is none.
+    void bindTarget() {
+      if (currentTarget) {
+        currentTarget->bind();
+        prim.setTargetHeight(currentTarget->getHeight());
+      } else {
+        RenderTarget::unbind();
+        prim.setTargetHeight(0);
+      }
+      setBlending();
+    }
+    void setBlending() {
+      if (currentTarget) {
+        // alpha accumulates as coverage, keeping the colors premultiplied
+        glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+      } else {
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+      }
+    }
+    // Primitives and sprites are batched separately, the other batch is drawn before
+    // starting to fill one so the drawing order is kept.
+    PrimitiveShader& primitives() {
+      sprites.flush();
+      return prim;
+    }
 
     PrimitiveShader prim;
+    SpriteBatch& sprites = SpriteBatch::getInstance();
     SpriteSheet fontSheet;
     std::vector<Point> scrollStack;
     Point currentScroll{0.0, 0.0};
+    Clip clip{false, 0, 0, 0, 0};
+    const RenderTarget* currentTarget = nullptr;
+    std::vector<TargetState> targetStack;
 
  };
 
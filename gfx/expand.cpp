@@ -0,0 +1,52 @@
+#include "expand.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define EXPAND_X86 1
+#endif
+
+static void expand_scalar(const unsigned char* indices, size_t count, const uint32_t* lut, uint32_t* rgba) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    rgba[i + 0] = lut[indices[i + 0]];
+    rgba[i + 1] = lut[indices[i + 1]];
+    rgba[i + 2] = lut[indices[i + 2]];
+    rgba[i + 3] = lut[indices[i + 3]];
+  }
+  for (; i < count; ++i) {
+    rgba[i] = lut[indices[i]];
+  }
+}
+
+#ifdef EXPAND_X86
+__attribute__((target("avx2")))
+static void expand_avx2(const unsigned char* indices, size_t count, const uint32_t* lut, uint32_t* rgba) {
+  size_t i = 0;
+  const int* table = (const int*)lut;
+  for (; i + 16 <= count; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)(indices + i));
+    __m256i low = _mm256_cvtepu8_epi32(bytes);
+    __m256i high = _mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8));
+    _mm256_storeu_si256((__m256i*)(rgba + i), _mm256_i32gather_epi32(table, low, 4));
+    _mm256_storeu_si256((__m256i*)(rgba + i + 8), _mm256_i32gather_epi32(table, high, 4));
+  }
+  expand_scalar(indices + i, count - i, lut, rgba + i);
+}
+#endif
+
+typedef void (*ExpandFunction)(const unsigned char*, size_t, const uint32_t*, uint32_t*);
+
+static ExpandFunction select_expand() {
+#ifdef EXPAND_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return expand_avx2;
+  }
+#endif
+  return expand_scalar;
+}
+
+void expand_indices(const unsigned char* indices, size_t count, const uint32_t* lut, uint32_t* rgba) {
+  static const ExpandFunction expand = select_expand();
+  expand(indices, count, lut, rgba);
+}
+
@@ -0,0 +1,8 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Expands count palette indices to RGBA8. lut holds 256 colors packed as 0xAABBGGRR,
+// which is R, G, B, A in memory, so rgba can go to GL_RGBA / GL_UNSIGNED_BYTE as is.
+// Uses AVX2 gathers when the CPU has them, a scalar loop otherwise.
+void expand_indices(const unsigned char* indices, size_t count, const uint32_t* lut, uint32_t* rgba);
@@ -1,19 +1,26 @@
 #include <GLES3/gl3.h>
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <vector>
+#include <cstddef>
 #include <cstring>
 #include "gfx.h"
 #include "lodepng.h"
 #include "main.h"
+#include "jobs.h"
 
     const int TILE_SIZE = 32;
-    const int MAP_W = 20;
-    const int MAP_H = 15;
     const int POINTS_PER_TILE = 6;
 
+// Atlas coordinates of a point of tile t, shared by both tilemap shaders.
+const std::string TILE_ATLAS_GLSL =
+    "vec2 atlasUv(float t, vec2 corner, float sheetsize, vec2 uvscale) { \n"
+    "  return ((corner + vec2(mod(t, sheetsize), floor(t/sheetsize))) / sheetsize) * uvscale; \n"
+    "} \n";
+
 
-unsigned int load_texture (const char *filename, unsigned int filter, int *out_w, int *out_h, float *out_u, float *out_v ) {
+unsigned int load_texture (const char *filename, unsigned int filter, int *out_w, int *out_h, float *out_u, float *out_v, bool pad) {
     std::vector<unsigned char> image;
     unsigned width, height;
     unsigned error = lodepng::decode(image, width, height, filename);
@@ -24,42 +31,41 @@ unsigned int load_texture (const char *filename, unsigned int filter, int *out_w
         std::cout << "error " << error << ": " << lodepng_error_text(error) << std::endl;
         return -1;
     }
-    // Texture size must be power of two for the primitive OpenGL version this is written for. Find next power of two.
-    size_t u2 = 1; while(u2 < width) u2 *= 2;
-    size_t v2 = 1; while(v2 < height) v2 *= 2;
-    // Ratio for power of two version compared to actual version, to render the non power of two image with proper size.
-    double u3 = (double)width / u2;
-    double v3 = (double)height / v2;
-
-    // Make power of two version of the image.
-    std::vector<unsigned char> image2(u2 * v2 * 4);
-    for(size_t y = 0; y < height; y++)
-        for(size_t x = 0; x < width; x++)
-            for(size_t c = 0; c < 4; c++)
-            {
-                image2[4 * u2 * y + 4 * x + c] = image[4 * width * y + 4 * x + c];
-            }
+    if (out_w) { *out_w = width; }
+    if (out_h) { *out_h = height; }
+    return upload_texture(image.data(), width, height, filter, out_u, out_v, pad);
+}
+
+unsigned int upload_texture(const unsigned char* image, unsigned width, unsigned height, unsigned int filter, float *out_u, float *out_v, bool pad) {
+    size_t textureWidth = width;
+    size_t textureHeight = height;
+    if (pad) {
+        textureWidth = 1; while(textureWidth < width) textureWidth *= 2;
+        textureHeight = 1; while(textureHeight < height) textureHeight *= 2;
+    }
 
     GLuint txt_id;
     glGenTextures( 1, &txt_id );
     glBindTexture( GL_TEXTURE_2D, txt_id );
-    glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA, u2, v2, 0, GL_RGBA, GL_UNSIGNED_BYTE, &image2[0] );
+    // RGBA8 rows are always 4 byte aligned, the row length may still be set by another upload
+    glPixelStorei( GL_UNPACK_ALIGNMENT, 4 );
+    glPixelStorei( GL_UNPACK_ROW_LENGTH, 0 );
+    if (pad) {
+        // the padding is cleared, linear filtering at the image edges samples it
+        std::vector<unsigned char> padded(textureWidth * textureHeight * 4, 0);
+        for(size_t y = 0; y < height; y++) {
+            memcpy(&padded[textureWidth * 4 * y], image + width * 4 * y, width * 4);
+        }
+        glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA, textureWidth, textureHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, padded.data() );
+    } else {
+        glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image );
+    }
     glTexParameterf( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter );
     glTexParameterf( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter );
 
-//    glGenTextures( 1, &txt_id );
-//    glBindTexture( GL_TEXTURE_2D, txt_id );
-//    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter );
-//    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter );
-//    glTexImage2D( GL_TEXTURE_2D, 0, 4, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image.data() );
-
-    if (out_w) { *out_w = width; }
-    if (out_h) { *out_h = height; }
-    if (out_u) { *out_u = u3; }
-    if (out_v) { *out_v = v3; }
+    if (out_u) { *out_u = (double)width / textureWidth; }
+    if (out_v) { *out_v = (double)height / textureHeight; }
     return txt_id;
-    
-//  return 0;
 }
 
 void destroy_texture(unsigned int texture) {
@@ -67,8 +73,135 @@ void destroy_texture(unsigned int texture) {
 }
 
 
-Image::Image(const std::string &filename) {
-  texture = load_texture(filename.c_str(), GL_LINEAR, &w, &h, nullptr, nullptr );
+Image::Image(const std::string &filename, bool pad) {
+  texture = load_texture(filename.c_str(), GL_LINEAR, &w, &h, &u, &v, pad);
+  ready = texture != (GLuint)-1;
+}
+
+Image::Image() : w(0), h(0), ready(false) {
+  const unsigned char transparent[4] = {0, 0, 0, 0};
+  texture = upload_texture(transparent, 1, 1, GL_LINEAR, &u, &v);
+}
+
+void Image::setPixels(const unsigned char* rgba, unsigned width, unsigned height, bool pad) {
+  SpriteBatch::releaseTexture(texture);
+  destroy_texture(texture);
+  texture = upload_texture(rgba, width, height, GL_LINEAR, &u, &v, pad);
+  w = width;
+  h = height;
+  ready = true;
+}
+
+Image::~Image() {
+  if (texture != (GLuint)-1) {
+    SpriteBatch::releaseTexture(texture);
+    destroy_texture(texture);
+  }
+}
+
+size_t Image::getTextureBytes() const {
+  if (texture == (GLuint)-1) {
+    return 0;
+  }
+  return (size_t)(w / u + 0.5f) * (size_t)(h / v + 0.5f) * 4;
+}
+
+std::shared_ptr<const Image> ImageCache::get(const std::string& filename, bool pad) {
+  auto& image = images[std::make_pair(filename, pad)];
+  if (image) {
+    hits += 1;
+  } else {
+    misses += 1;
+    image = std::make_shared<Image>(filename, pad);
+  }
+  return image;
+}
+
+std::shared_ptr<const Image> ImageCache::getAsync(const std::string& filename, bool pad) {
+  auto& image = images[std::make_pair(filename, pad)];
+  if (image) {
+    hits += 1;
+    return image;
+  }
+  misses += 1;
+  image = std::make_shared<Image>();
+  std::shared_ptr<Image> target = image;
+  submitJob([target, filename, pad] {
+    auto pixels = std::make_shared<std::vector<unsigned char>>();
+    unsigned width, height;
+    unsigned error = lodepng::decode(*pixels, width, height, filename);
+    if (error != 0) {
+      std::cout << "error " << error << ": " << lodepng_error_text(error) << " in " << filename << std::endl;
+      return;
+    }
+    runOnMainThread([target, pixels, width, height, pad] {
+      target->setPixels(pixels->data(), width, height, pad);
+      // renderings cached while the placeholder was shown are out of date
+      requestRedraw(true);
+    }, pixels->size());
+  });
+  return image;
+}
+
+RenderTarget::RenderTarget(int width, int height) : w(width), h(height) {
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+  glGenFramebuffers(1, &framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+  GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  if (status != GL_FRAMEBUFFER_COMPLETE) {
+    std::cout << "Render target " << w << "x" << h << " incomplete: " << status << std::endl;
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+RenderTarget::~RenderTarget() {
+  glDeleteFramebuffers(1, &framebuffer);
+  glDeleteTextures(1, &texture);
+}
+
+void RenderTarget::bind() const {
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  // the viewport stays screen sized, shifted so its top edge is the target's top edge
+  glViewport(0, h - screen_h, screen_w, screen_h);
+}
+
+void RenderTarget::unbind() {
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glViewport(0, 0, screen_w, screen_h);
+}
+
+void ImageCache::evict(const std::string& filename, bool pad) {
+  images.erase(std::make_pair(filename, pad));
+}
+
+void ImageCache::evictUnused() {
+  for (auto it = images.begin(); it != images.end(); ) {
+    if (it->second.use_count() == 1) {
+      it = images.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+size_t ImageCache::getResidentBytes() const {
+  size_t bytes = 0;
+  for (const auto& entry : images) {
+    bytes += entry.second->getTextureBytes();
+  }
+  return bytes;
+}
+
+void ImageCache::report(std::ostream& os) const {
+  os << "ImageCache: " << images.size() << " images, " << hits << " hits, " << misses << " misses, "
+     << getResidentBytes() / 1024 << " KB resident" << std::endl;
 }
 
 GLuint createShader(GLuint type, const std::string &source) {
@@ -111,48 +244,55 @@ class TilemapShader {
       }
       return *instance;
     }
-    GLuint buildVao(int map_w, int map_h, int tile_w, int tile_h, int sheetsize, int tile_dx, int tile_dy, GLuint *buffer);
-    void drawTilemap(int scroll_x, int scroll_y, const Image& image, GLint vao, int w, int h, int sheetsize, bool skipzero);
-    void updateTiles(GLint vao, GLint buffer, int* data, int map_w, int map_h);
+    GLuint buildVao(GLuint tileBuffer);
+    void begin(const Image& image, int tile_w, int tile_h, int tile_dx, int tile_dy, int sheetsize, bool skipzero);
+    void drawChunk(GLuint vao, int offset_x, int offset_y, int chunk_w, int tiles);
   private:
     static TilemapShader* instance;
     TilemapShader();
     GLuint program;
-    GLint a_positionLocation;
-    GLint a_texcoordLocation;
+    GLuint quadBuffer;
+    GLint a_cornerLocation;
     GLint a_tileLocation;
-    GLuint positionBuffer;
-    GLuint texcoordBuffer;
-    GLuint tileBuffer;
     GLint u_scroll;
+    GLint u_tilesize;
+    GLint u_tilestep;
+    GLint u_chunkwidth;
     GLint u_sheetsize;
+    GLint u_uvscale;
     GLint u_skipzero;
     GLint u_screensize;
 };
 
 
 TilemapShader::TilemapShader() {
+  // One quad per tile instance, placed from gl_InstanceID within its chunk.
   std::string vertexShader = "#version 300 es \n"
-    "in vec2 a_position; \n"
-    "in vec2 a_texcoord; \n"
+    "in vec2 a_corner; \n"
     "in float a_tile; \n"
     "out vec2 v_texcoord; \n"
     "uniform vec2 u_scroll; \n"
+    "uniform vec2 u_tilesize; \n"
+    "uniform vec2 u_tilestep; \n"
+    "uniform int u_chunkwidth; \n"
     "uniform float u_sheetsize; \n"
+    "uniform vec2 u_uvscale; \n"
     "uniform bool u_skipzero; \n"
     "uniform vec2 u_screensize; \n"
+    + TILE_ATLAS_GLSL +
     "void main() { \n"
     "  if (a_tile < 0.5 && u_skipzero) { \n"
     "    gl_Position = vec4(0.0, 0.0, 0.0, 1.0); \n"
     "  } else { \n"
-    "    vec2 pos = a_position + u_scroll;\n"
+    "    vec2 cell = vec2(gl_InstanceID % u_chunkwidth, gl_InstanceID / u_chunkwidth); \n"
+    "    vec2 pos = a_corner * u_tilesize + cell * u_tilestep + u_scroll;\n"
     "    vec2 scaled_pos = ((pos/u_screensize) * 2.0 - 1.0) * vec2(1.0, -1.0); \n"
     "    gl_Position = vec4(scaled_pos, 1.0, 1.0); \n"
     "    float t = a_tile; \n"
     "    if (u_skipzero) { \n"
     "      t--; \n"
     "    } \n"
-    "    v_texcoord = a_texcoord + vec2(mod(t, u_sheetsize)/u_sheetsize, floor(t/u_sheetsize)/u_sheetsize); \n"
+    "    v_texcoord = atlasUv(t, a_corner, u_sheetsize, u_uvscale); \n"
     "  } \n "
     "} \n";
   std::string fragmentShader = "#version 300 es \n"
@@ -166,129 +306,55 @@ TilemapShader::TilemapShader() {
 
   program = createProgram(vertexShader, fragmentShader);
   glUseProgram(program);
+  a_cornerLocation = glGetAttribLocation(program, "a_corner");
+  a_tileLocation = glGetAttribLocation(program, "a_tile");
   u_scroll = glGetUniformLocation(program, "u_scroll");
+  u_tilesize = glGetUniformLocation(program, "u_tilesize");
+  u_tilestep = glGetUniformLocation(program, "u_tilestep");
+  u_chunkwidth = glGetUniformLocation(program, "u_chunkwidth");
   u_sheetsize = glGetUniformLocation(program, "u_sheetsize");
-  glUniform2f(u_scroll, 40, 40);
+  u_uvscale = glGetUniformLocation(program, "u_uvscale");
   u_skipzero = glGetUniformLocation(program, "u_skipzero");
   u_screensize = glGetUniformLocation(program, "u_screensize");
+
+  const GLfloat corners[] = { 0, 0,   0, 1,   1, 0,
+                              0, 1,   1, 0,   1, 1 };
+  glGenBuffers(1, &quadBuffer);
+  glBindBuffer(GL_ARRAY_BUFFER, quadBuffer);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
 }
 
-GLuint TilemapShader::buildVao(int map_w, int map_h, int tile_w, int tile_h, int sheetsize, int tile_dx, int tile_dy, GLuint* tileBuffer) {
-  glUseProgram(program);
+GLuint TilemapShader::buildVao(GLuint tileBuffer) {
   GLuint vao;
   glGenVertexArrays(1, &vao);
   glBindVertexArray(vao);
-
-  {
-    const int pointsNumber = POINTS_PER_TILE * 2 * map_w * map_h;
-    GLfloat positions[pointsNumber];
-    GLfloat base_positions[] = {  0,   0,    0, (float)tile_h,   (float)tile_w,   0,
-                                  0, (float)tile_h, (float)tile_w, 0,   (float)tile_w, (float)tile_h};
-    for (int y=0; y<map_h; y++) {
-      for (int x=0; x<map_w; x++) {
-        int offset = x * POINTS_PER_TILE * 2 + y * map_w * POINTS_PER_TILE * 2;
-        for (int i=0; i<POINTS_PER_TILE; i++) {
-          int point_offset = offset + i * 2;
-          positions[point_offset] = base_positions[i*2] + x * tile_dx;
-          positions[point_offset+1] = base_positions[i*2+1] + y * tile_dy;
-        }
-      }
-    }
-    a_positionLocation = glGetAttribLocation(program, "a_position");
-    glGenBuffers(1, &positionBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, positionBuffer);
-    glBufferData(GL_ARRAY_BUFFER, pointsNumber * sizeof(positions[0]), positions, GL_STATIC_DRAW);
-    glEnableVertexAttribArray(a_positionLocation);
-    glVertexAttribPointer(a_positionLocation, 2, GL_FLOAT, false, 0, 0);
-  }
-
-  {
-    const int pointsNumber = POINTS_PER_TILE * 2 * map_w * map_h;
-     GLfloat positions[pointsNumber];
-    GLfloat base_positions[] = {  0,   0,    0,   1/(float)sheetsize,   1/(float)sheetsize,   0,
-                                  0,   1/(float)sheetsize,    1/(float)sheetsize,   0,   1/(float)sheetsize,   1/(float)sheetsize};
-    for (int y=0; y<map_h; y++) {
-      for (int x=0; x<map_w; x++) {
-        int offset = x * POINTS_PER_TILE * 2 + y * map_w * POINTS_PER_TILE * 2;
-        for (int i=0; i<POINTS_PER_TILE; i++) {
-          int point_offset = offset + i * 2;
-          positions[point_offset] = base_positions[i*2];
-          positions[point_offset+1] = base_positions[i*2+1];
-        }
-      }
-    }
-    a_texcoordLocation = glGetAttribLocation(program, "a_texcoord");
-    glGenBuffers(1, &texcoordBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, texcoordBuffer);
-    glBufferData(GL_ARRAY_BUFFER, pointsNumber * sizeof(positions[0]), positions, GL_STATIC_DRAW);
-    glEnableVertexAttribArray(a_texcoordLocation);
-    glVertexAttribPointer(a_texcoordLocation, 2, GL_FLOAT, false, 0, 0);
-  }
-
-  {
-    GLfloat base_positions[] = { 2, 3, 3, 3, 4, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-                                 2, 3, 3, 3, 4, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-                                 2, 3, 3, 3, 4, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-                                 2, 3, 3, 3, 4, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-                                 2, 3, 3, 3, 4, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-                                 2, 3, 3, 3, 4, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-                                 2, 3, 3, 3, 4, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-                                 2, 3, 3, 3, 4, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-                                 2, 3, 3, 3, 4, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-                                 2, 3, 3, 3, 4, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-                                 2, 3, 3, 3, 4, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-                                 2, 3, 3, 3, 4, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-                                 2, 3, 3, 3, 4, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-                                 2, 3, 3, 3, 4, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-                                 2, 3, 3, 3, 4, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-    GLfloat positions[map_w*map_h*POINTS_PER_TILE];
-    for (int y=0; y<map_h; y++) {
-      for (int x=0; x<map_w; x++) {
-        int offset = x * POINTS_PER_TILE + y * map_w * POINTS_PER_TILE;
-        for (int i=0; i<POINTS_PER_TILE; i++) {
-          int point_offset = offset + i;
-          positions[point_offset] = base_positions[x+y*map_w];
-        }
-      }
-    }
-    a_tileLocation = glGetAttribLocation(program, "a_tile");
-    glGenBuffers(1, tileBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, *tileBuffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(positions), positions, GL_DYNAMIC_DRAW);
-    glEnableVertexAttribArray(a_tileLocation);
-    glVertexAttribPointer(a_tileLocation, 1, GL_FLOAT, false, 0, 0);
-  }
+  glBindBuffer(GL_ARRAY_BUFFER, quadBuffer);
+  glEnableVertexAttribArray(a_cornerLocation);
+  glVertexAttribPointer(a_cornerLocation, 2, GL_FLOAT, false, 0, 0);
+  glBindBuffer(GL_ARRAY_BUFFER, tileBuffer);
+  glEnableVertexAttribArray(a_tileLocation);
+  glVertexAttribPointer(a_tileLocation, 1, GL_UNSIGNED_SHORT, false, 0, 0);
+  glVertexAttribDivisor(a_tileLocation, 1);
+  glBindVertexArray(0);
   return vao;
 }
 
-void TilemapShader::updateTiles(int vao, int vbo, int* data, int map_w, int map_h) {
-    GLfloat positions[map_w*map_h*POINTS_PER_TILE];
-    for (int y=0; y<map_h; y++) {
-      for (int x=0; x<map_w; x++) {
-        int offset = x * POINTS_PER_TILE + y * map_w * POINTS_PER_TILE;
-        GLfloat tile = data[x+y*map_w];
-        for (int i=0; i<POINTS_PER_TILE; i++) {
-          int point_offset = offset + i;
-          positions[point_offset] = tile;
-        }
-      }
-    }
-    glBindVertexArray(vao);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(positions), positions, GL_DYNAMIC_DRAW);
-}
-
-void TilemapShader::drawTilemap(int scroll_x, int scroll_y, const Image& image, GLint vao, int w, int h, int sheetsize, bool skipzero) {
+void TilemapShader::begin(const Image& image, int tile_w, int tile_h, int tile_dx, int tile_dy, int sheetsize, bool skipzero) {
   glUseProgram(program);
-  glBindVertexArray(vao);
   glBindTexture(GL_TEXTURE_2D, image.getTexture());
-  glUniform2f(u_scroll, scroll_x, scroll_y);
+  glUniform2f(u_tilesize, tile_w, tile_h);
+  glUniform2f(u_tilestep, tile_dx, tile_dy);
   glUniform1f(u_sheetsize, sheetsize);
+  glUniform2f(u_uvscale, image.getU(), image.getV());
   glUniform2f(u_screensize, screen_w, screen_h);
   glUniform1i(u_skipzero, skipzero);
-  GLint offset = 0;
-  GLsizei count = POINTS_PER_TILE * w * h;
-  glDrawArrays(GL_TRIANGLES, offset, count);
+}
+
+void TilemapShader::drawChunk(GLuint vao, int offset_x, int offset_y, int chunk_w, int tiles) {
+  glUniform2f(u_scroll, offset_x, offset_y);
+  glUniform1i(u_chunkwidth, chunk_w);
+  glBindVertexArray(vao);
+  glDrawArraysInstanced(GL_TRIANGLES, 0, POINTS_PER_TILE, tiles);
 }
 
 Tilemap::Tilemap(const Image& image, int width, int height, int tile_w, int tile_h, int tile_dx, int tile_dy, bool skipzero)
@@ -301,81 +367,332 @@ Tilemap::Tilemap(const Image& image, int width, int height, int tile_w, int tile
     tileDy(tile_dy ? tile_dy : tile_h),
     sheetSize(image.getWidth()/tileWidth),
     skipZero(skipzero),
-    grid(new int[width*height]),
-    needRebuild(false) {
-  memset(grid, 0, width*height*sizeof(int));
+    chunksX((width + CHUNK_SIZE - 1) / CHUNK_SIZE),
+    chunksDrawn(0) {
   TilemapShader& shader = TilemapShader::getInstance();
-  vao = shader.buildVao(width, height, tileWidth, tileHeight, sheetSize, tileDx, tileDy, &buffer);
-  rebuild();
+  for (int y=0; y<height; y+=CHUNK_SIZE) {
+    for (int x=0; x<width; x+=CHUNK_SIZE) {
+      Chunk chunk;
+      chunk.x = x;
+      chunk.y = y;
+      chunk.w = std::min(CHUNK_SIZE, width - x);
+      chunk.h = std::min(CHUNK_SIZE, height - y);
+      chunk.tiles.assign((size_t)chunk.w * chunk.h, 0);
+      chunk.used = 0;
+      chunk.dirtyBegin = chunk.tiles.size();
+      chunk.dirtyEnd = 0;
+      glGenBuffers(1, &chunk.tileBuffer);
+      glBindBuffer(GL_ARRAY_BUFFER, chunk.tileBuffer);
+      glBufferData(GL_ARRAY_BUFFER, chunk.tiles.size() * sizeof(GLushort), chunk.tiles.data(), GL_DYNAMIC_DRAW);
+      chunk.vao = shader.buildVao(chunk.tileBuffer);
+      chunks.push_back(std::move(chunk));
+    }
+  }
+}
+
+Tilemap::~Tilemap() {
+  for (Chunk& chunk : chunks) {
+    glDeleteVertexArrays(1, &chunk.vao);
+    glDeleteBuffers(1, &chunk.tileBuffer);
+  }
 }
 
-void Tilemap::rebuild() {
-  TilemapShader::getInstance().updateTiles(vao, buffer, grid, width, height);
-  needRebuild = false;
+size_t Tilemap::getVertexBytes() const {
+  return (size_t)width * height * sizeof(GLushort);
+}
+
+void Tilemap::uploadDirty() {
+  for (int index : dirtyChunks) {
+    Chunk& chunk = chunks[index];
+    glBindBuffer(GL_ARRAY_BUFFER, chunk.tileBuffer);
+    glBufferSubData(GL_ARRAY_BUFFER, chunk.dirtyBegin * sizeof(GLushort),
+                    (chunk.dirtyEnd - chunk.dirtyBegin) * sizeof(GLushort), chunk.tiles.data() + chunk.dirtyBegin);
+    chunk.dirtyBegin = chunk.tiles.size();
+    chunk.dirtyEnd = 0;
+  }
+  dirtyChunks.clear();
+}
+
+// Rounds towards negative infinity, unlike the / operator.
+static int floorDiv(int a, int b) {
+  return a / b - (a % b != 0 && (a < 0) != (b < 0));
 }
 
 void Tilemap::drawTilemap(int x, int y) {
-  if (needRebuild) {
-    rebuild();
+  uploadDirty();
+  chunksDrawn = 0;
+  if (chunks.empty()) {
+    return;
+  }
+  // only the chunks overlapping the screen; the extent is the one of a full chunk
+  const int spanX = CHUNK_SIZE * tileDx;
+  const int spanY = CHUNK_SIZE * tileDy;
+  const int extentX = (CHUNK_SIZE - 1) * tileDx + tileWidth;
+  const int extentY = (CHUNK_SIZE - 1) * tileDy + tileHeight;
+  const int chunksY = chunks.size() / chunksX;
+  int cx0 = std::max(0, floorDiv(-x - extentX, spanX) + 1);
+  int cy0 = std::max(0, floorDiv(-y - extentY, spanY) + 1);
+  int cx1 = std::min(chunksX - 1, floorDiv(screen_w - 1 - x, spanX));
+  int cy1 = std::min(chunksY - 1, floorDiv(screen_h - 1 - y, spanY));
+  if (cx0 > cx1 || cy0 > cy1) {
+    return;
+  }
+  TilemapShader& shader = TilemapShader::getInstance();
+  shader.begin(image, tileWidth, tileHeight, tileDx, tileDy, sheetSize, skipZero);
+  for (int cy=cy0; cy<=cy1; cy++) {
+    for (int cx=cx0; cx<=cx1; cx++) {
+      const Chunk& chunk = chunks[cx + cy * chunksX];
+      if (skipZero && chunk.used == 0) {
+        continue;
+      }
+      shader.drawChunk(chunk.vao, x + chunk.x * tileDx, y + chunk.y * tileDy, chunk.w, chunk.w * chunk.h);
+      chunksDrawn++;
+    }
   }
-  TilemapShader::getInstance().drawTilemap(x, y, image, vao, width, height, sheetSize, skipZero);
 }
 
 void Tilemap::setAt(int x, int y, int newTile) {
-  if (grid[x+y*width] != newTile) {
-    grid[x+y*width] = newTile;
-    needRebuild = true;
+  int index = x / CHUNK_SIZE + (y / CHUNK_SIZE) * chunksX;
+  Chunk& chunk = chunks[index];
+  size_t offset = (x - chunk.x) + (size_t)(y - chunk.y) * chunk.w;
+  if (chunk.tiles[offset] == newTile) {
+    return;
+  }
+  if (chunk.tiles[offset] == 0) {
+    chunk.used++;
+  } else if (newTile == 0) {
+    chunk.used--;
   }
+  chunk.tiles[offset] = newTile;
+  if (chunk.dirtyBegin >= chunk.dirtyEnd) {
+    dirtyChunks.push_back(index);
+  }
+  chunk.dirtyBegin = std::min(chunk.dirtyBegin, offset);
+  chunk.dirtyEnd = std::max(chunk.dirtyEnd, offset + 1);
 }
 
 TilemapShader* TilemapShader::instance = nullptr;
 
-
-
-class SpriteShader {
+class TileTextureShader {
   public:
-    static SpriteShader& getInstance() {
+    static TileTextureShader& getInstance() {
       if (instance == nullptr) {
-        instance = new SpriteShader();
+        instance = new TileTextureShader();
       }
       return *instance;
     }
-    void drawSprite(const Image& image, int x, int y, int tile, int sheetsize, int scale_x, int scale_y, double angle = 0.0);
+    void draw(const Image& image, GLuint map, int rect_x, int rect_y, int rect_w, int rect_h, int scroll_x, int scroll_y,
+              int tile_w, int tile_h, int tile_dx, int tile_dy, int sheetsize, bool skipzero);
   private:
-    static SpriteShader* instance;
-    SpriteShader();
-    GLuint vao;
+    static TileTextureShader* instance;
+    TileTextureShader();
     GLuint program;
-    GLint a_positionLocation;
-    GLint a_texcoordLocation;
-    GLuint positionBuffer;
-    GLuint texcoordBuffer;
+    GLuint vao;
+    GLuint quadBuffer;
+    GLint u_rectpos;
+    GLint u_rectsize;
     GLint u_scroll;
-    GLint u_scale;
-    GLint u_angle;
-    GLint u_tile;
+    GLint u_tilesize;
+    GLint u_tilestep;
     GLint u_sheetsize;
+    GLint u_uvscale;
     GLint u_skipzero;
     GLint u_screensize;
 };
 
-SpriteShader* SpriteShader::instance = nullptr;
+TileTextureShader* TileTextureShader::instance = nullptr;
+
+TileTextureShader::TileTextureShader() {
+  std::string vertexShader = "#version 300 es \n"
+    "in vec2 a_corner; \n"
+    "out vec2 v_pos; \n"
+    "uniform vec2 u_rectpos; \n"
+    "uniform vec2 u_rectsize; \n"
+    "uniform vec2 u_screensize; \n"
+    "void main() { \n"
+    "  v_pos = u_rectpos + a_corner * u_rectsize; \n"
+    "  vec2 scaled_pos = ((v_pos/u_screensize) * 2.0 - 1.0) * vec2(1.0, -1.0); \n"
+    "  gl_Position = vec4(scaled_pos, 1.0, 1.0); \n"
+    "} \n";
+  // Looks up the tile under each pixel. Tiles smaller than their step leave gaps like
+  // in the vertex path, larger ones are cut at the step instead of overlapping.
+  std::string fragmentShader = "#version 300 es \n"
+    "precision highp float; \n"
+    "precision highp usampler2D; \n"
+    "in vec2 v_pos; \n"
+    "uniform sampler2D u_texture; \n"
+    "uniform usampler2D u_map; \n"
+    "uniform vec2 u_scroll; \n"
+    "uniform vec2 u_tilesize; \n"
+    "uniform vec2 u_tilestep; \n"
+    "uniform float u_sheetsize; \n"
+    "uniform vec2 u_uvscale; \n"
+    "uniform bool u_skipzero; \n"
+    "out vec4 outColor; \n"
+    + TILE_ATLAS_GLSL +
+    "void main() { \n"
+    "  vec2 pos = v_pos - u_scroll; \n"
+    "  vec2 cell = floor(pos / u_tilestep); \n"
+    "  vec2 corner = (pos - cell * u_tilestep) / u_tilesize; \n"
+    "  if (corner.x >= 1.0 || corner.y >= 1.0) { \n"
+    "    discard; \n"
+    "  } \n"
+    "  float t = float(texelFetch(u_map, ivec2(cell), 0).r); \n"
+    "  if (u_skipzero) { \n"
+    "    if (t < 0.5) { \n"
+    "      discard; \n"
+    "    } \n"
+    "    t--; \n"
+    "  } \n"
+    "  outColor = textureLod(u_texture, atlasUv(t, corner, u_sheetsize, u_uvscale), 0.0); \n"
+    "} \n";
+
+  program = createProgram(vertexShader, fragmentShader);
+  glUseProgram(program);
+  GLint a_cornerLocation = glGetAttribLocation(program, "a_corner");
+  u_rectpos = glGetUniformLocation(program, "u_rectpos");
+  u_rectsize = glGetUniformLocation(program, "u_rectsize");
+  u_scroll = glGetUniformLocation(program, "u_scroll");
+  u_tilesize = glGetUniformLocation(program, "u_tilesize");
+  u_tilestep = glGetUniformLocation(program, "u_tilestep");
+  u_sheetsize = glGetUniformLocation(program, "u_sheetsize");
+  u_uvscale = glGetUniformLocation(program, "u_uvscale");
+  u_skipzero = glGetUniformLocation(program, "u_skipzero");
+  u_screensize = glGetUniformLocation(program, "u_screensize");
+  glUniform1i(glGetUniformLocation(program, "u_texture"), 0);
+  glUniform1i(glGetUniformLocation(program, "u_map"), 1);
+
+  const GLfloat corners[] = { 0, 0,   0, 1,   1, 0,
+                              0, 1,   1, 0,   1, 1 };
+  glGenVertexArrays(1, &vao);
+  glBindVertexArray(vao);
+  glGenBuffers(1, &quadBuffer);
+  glBindBuffer(GL_ARRAY_BUFFER, quadBuffer);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+  glEnableVertexAttribArray(a_cornerLocation);
+  glVertexAttribPointer(a_cornerLocation, 2, GL_FLOAT, false, 0, 0);
+  glBindVertexArray(0);
+}
+
+void TileTextureShader::draw(const Image& image, GLuint map, int rect_x, int rect_y, int rect_w, int rect_h, int scroll_x, int scroll_y,
+                             int tile_w, int tile_h, int tile_dx, int tile_dy, int sheetsize, bool skipzero) {
+  glUseProgram(program);
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, map);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, image.getTexture());
+  glUniform2f(u_rectpos, rect_x, rect_y);
+  glUniform2f(u_rectsize, rect_w, rect_h);
+  glUniform2f(u_scroll, scroll_x, scroll_y);
+  glUniform2f(u_tilesize, tile_w, tile_h);
+  glUniform2f(u_tilestep, tile_dx, tile_dy);
+  glUniform1f(u_sheetsize, sheetsize);
+  glUniform2f(u_uvscale, image.getU(), image.getV());
+  glUniform1i(u_skipzero, skipzero);
+  glUniform2f(u_screensize, screen_w, screen_h);
+  glBindVertexArray(vao);
+  glDrawArrays(GL_TRIANGLES, 0, POINTS_PER_TILE);
+}
+
+TextureTilemap::TextureTilemap(const Image& image, int width, int height, int tile_w, int tile_h, int tile_dx, int tile_dy, bool skipzero)
+  : image(image),
+    width(width),
+    height(height),
+    tileWidth(tile_w),
+    tileHeight(tile_h),
+    tileDx(tile_dx ? tile_dx : tile_w),
+    tileDy(tile_dy ? tile_dy : tile_h),
+    sheetSize(image.getWidth()/tileWidth),
+    skipZero(skipzero),
+    tiles((size_t)width * height, 0) {
+  glGenTextures(1, &mapTexture);
+  glBindTexture(GL_TEXTURE_2D, mapTexture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R16UI, width, height, 0, GL_RED_INTEGER, GL_UNSIGNED_SHORT, tiles.data());
+}
+
+TextureTilemap::~TextureTilemap() {
+  glDeleteTextures(1, &mapTexture);
+}
+
+size_t TextureTilemap::getTextureBytes() const {
+  return tiles.size() * sizeof(GLushort);
+}
+
+void TextureTilemap::drawTilemap(int x, int y) {
+  // only the part of the screen the map covers
+  int x0 = std::max(0, x);
+  int y0 = std::max(0, y);
+  int x1 = std::min(screen_w, x + (width - 1) * tileDx + tileWidth);
+  int y1 = std::min(screen_h, y + (height - 1) * tileDy + tileHeight);
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+  TileTextureShader::getInstance().draw(image, mapTexture, x0, y0, x1 - x0, y1 - y0, x, y,
+                                        tileWidth, tileHeight, tileDx, tileDy, sheetSize, skipZero);
+}
+
+void TextureTilemap::setAt(int x, int y, int newTile) {
+  GLushort& tile = tiles[x + (size_t)y * width];
+  if (tile == newTile) {
+    return;
+  }
+  tile = newTile;
+  glBindTexture(GL_TEXTURE_2D, mapTexture);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, 1, 1, GL_RED_INTEGER, GL_UNSIGNED_SHORT, &tile);
+}
+
+
+
+// Created on first use, releaseTexture must not create it.
+static SpriteBatch* spriteBatch = nullptr;
 
-SpriteShader::SpriteShader() {
+SpriteBatch& SpriteBatch::getInstance() {
+  if (!spriteBatch) {
+    spriteBatch = new SpriteBatch();
+  }
+  return *spriteBatch;
+}
+
+void SpriteBatch::releaseTexture(GLuint texture) {
+  if (!spriteBatch) {
+    return;
+  }
+  auto& runs = spriteBatch->textRuns;
+  for (auto it = runs.begin(); it != runs.end(); ) {
+    if (std::get<2>(it->first) == texture) {
+      glDeleteVertexArrays(1, &it->second.vao);
+      glDeleteBuffers(1, &it->second.buffer);
+      spriteBatch->textBytes -= it->second.count * sizeof(Instance);
+      it = runs.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+SpriteBatch::SpriteBatch() {
   std::string vertexShader = "#version 300 es \n"
     "in vec2 a_position; \n"
     "in vec2 a_texcoord; \n"
+    "in vec4 a_placement; \n" // x, y, scale x, scale y
+    "in vec3 a_frame; \n" // angle, tile, sheet size
     "out vec2 v_texcoord; \n"
-    "uniform float u_tile; \n"
-    "uniform vec2 u_scroll; \n"
-    "uniform vec2 u_scale; \n"
-    "uniform float u_angle; \n"
-    "uniform float u_sheetsize; \n"
+    "uniform vec2 u_uvscale; \n"
+    "uniform vec2 u_offset; \n"
     "uniform vec2 u_screensize; \n"
     "void main() { \n"
-    "  v_texcoord = (a_texcoord/u_sheetsize) + vec2(mod(u_tile, u_sheetsize)/u_sheetsize, floor(u_tile/u_sheetsize)/u_sheetsize); \n"
-    "  vec2 rotated_pos = a_position * mat2(cos(u_angle), -sin(u_angle), sin(u_angle), cos(u_angle)); \n"
-    "  vec2 pos = (rotated_pos * u_scale) + u_scroll;\n"
+    "  float angle = a_frame.x; \n"
+    "  float tile = a_frame.y; \n"
+    "  float sheetsize = a_frame.z; \n"
+    "  v_texcoord = ((a_texcoord/sheetsize) + vec2(mod(tile, sheetsize)/sheetsize, floor(tile/sheetsize)/sheetsize)) * u_uvscale; \n"
+    "  vec2 rotated_pos = a_position * mat2(cos(angle), -sin(angle), sin(angle), cos(angle)); \n"
+    "  vec2 pos = (rotated_pos * a_placement.zw) + a_placement.xy + u_offset;\n"
     "  vec2 scaled_pos = ((pos/u_screensize) * 2.0 - 1.0) * vec2(1.0, -1.0); \n"
     "  gl_Position = vec4(scaled_pos, 1.0, 1.0); \n"
     "}\n";
@@ -390,88 +707,190 @@ SpriteShader::SpriteShader() {
 
   program = createProgram(vertexShader, fragmentShader);
   glUseProgram(program);
-  glGenVertexArrays(1, &vao);
-  glBindVertexArray(vao);
 
   GLfloat positions[12] = {-0.5,-0.5, -0.5,0.5, 0.5,-0.5,  -0.5,0.5, 0.5,-0.5, 0.5,0.5};
-  a_positionLocation = glGetAttribLocation(program, "a_position");
   glGenBuffers(1, &positionBuffer);
   glBindBuffer(GL_ARRAY_BUFFER, positionBuffer);
   glBufferData(GL_ARRAY_BUFFER, sizeof(positions), positions, GL_STATIC_DRAW);
-  glEnableVertexAttribArray(a_positionLocation);
-  glVertexAttribPointer(a_positionLocation, 2, GL_FLOAT, false, 0, 0);
 
   GLfloat texcoords[12] = {0,0, 0,1, 1,0,  0,1, 1,0, 1,1};
-  a_texcoordLocation = glGetAttribLocation(program, "a_texcoord");
   glGenBuffers(1, &texcoordBuffer);
   glBindBuffer(GL_ARRAY_BUFFER, texcoordBuffer);
   glBufferData(GL_ARRAY_BUFFER, sizeof(texcoords), texcoords, GL_STATIC_DRAW);
+
+  glGenBuffers(1, &instanceBuffer);
+  vao = createVao(instanceBuffer);
+
+  u_uvscale = glGetUniformLocation(program, "u_uvscale");
+  u_offset = glGetUniformLocation(program, "u_offset");
+  u_screensize = glGetUniformLocation(program, "u_screensize");
+}
+
+GLuint SpriteBatch::createVao(GLuint instances) {
+  GLuint newVao;
+  glGenVertexArrays(1, &newVao);
+  glBindVertexArray(newVao);
+
+  GLint a_positionLocation = glGetAttribLocation(program, "a_position");
+  glBindBuffer(GL_ARRAY_BUFFER, positionBuffer);
+  glEnableVertexAttribArray(a_positionLocation);
+  glVertexAttribPointer(a_positionLocation, 2, GL_FLOAT, false, 0, 0);
+
+  GLint a_texcoordLocation = glGetAttribLocation(program, "a_texcoord");
+  glBindBuffer(GL_ARRAY_BUFFER, texcoordBuffer);
   glEnableVertexAttribArray(a_texcoordLocation);
   glVertexAttribPointer(a_texcoordLocation, 2, GL_FLOAT, false, 0, 0);
 
-  u_scroll = glGetUniformLocation(program, "u_scroll");
-  u_tile = glGetUniformLocation(program, "u_tile");
-  u_scale = glGetUniformLocation(program, "u_scale");
-  u_sheetsize = glGetUniformLocation(program, "u_sheetsize");
-  u_screensize = glGetUniformLocation(program, "u_screensize");
-  u_angle = glGetUniformLocation(program, "u_angle");
+  // one Instance per sprite, advanced once per instance instead of per vertex
+  GLint a_placementLocation = glGetAttribLocation(program, "a_placement");
+  GLint a_frameLocation = glGetAttribLocation(program, "a_frame");
+  glBindBuffer(GL_ARRAY_BUFFER, instances);
+  glEnableVertexAttribArray(a_placementLocation);
+  glVertexAttribPointer(a_placementLocation, 4, GL_FLOAT, false, sizeof(Instance), (void*)offsetof(Instance, x));
+  glVertexAttribDivisor(a_placementLocation, 1);
+  glEnableVertexAttribArray(a_frameLocation);
+  glVertexAttribPointer(a_frameLocation, 3, GL_FLOAT, false, sizeof(Instance), (void*)offsetof(Instance, angle));
+  glVertexAttribDivisor(a_frameLocation, 1);
+  glBindVertexArray(0);
+  return newVao;
 }
 
-void SpriteShader::drawSprite(const Image& image, int x, int y, int tile, int sheetsize, int scale_x, int scale_y, double angle) {
+void SpriteBatch::drawText(const SpriteSheet& font, int x, int y, const std::string& text, float size) {
+  const Image& image = font.getImage();
+  if (!image.isReady()) {
+    // nothing to show before the font is loaded, and the layout needs its size
+    return;
+  }
+  flush();
+  auto key = std::make_tuple(text, size, image.getTexture(), font.getFrameWidth(), font.getFrameHeight(), font.getSheetSize());
+  auto it = textRuns.find(key);
+  if (it == textRuns.end()) {
+    const float kern = 0.8;
+    std::vector<Instance> glyphs;
+    int glyphX = 0;
+    int glyphY = 0;
+    for (char c: text) {
+      if (c == '\n') {
+        glyphX = 0;
+        glyphY += 20;
+      }
+      else {
+        glyphs.push_back(Instance{(GLfloat)glyphX, (GLfloat)glyphY, font.getFrameWidth() * size, font.getFrameHeight() * size,
+                                  0, (GLfloat)c, (GLfloat)font.getSheetSize()});
+        glyphX += font.getFrameWidth() * kern * size;
+      }
+    }
+    TextRun run;
+    run.count = glyphs.size();
+    glGenBuffers(1, &run.buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, run.buffer);
+    glBufferData(GL_ARRAY_BUFFER, glyphs.size() * sizeof(Instance), glyphs.data(), GL_STATIC_DRAW);
+    run.vao = createVao(run.buffer);
+    textBytes += glyphs.size() * sizeof(Instance);
+    it = textRuns.emplace(key, run).first;
+  }
+  it->second.lastUsed = frame;
   glUseProgram(program);
-  glBindVertexArray(vao);
+  glBindVertexArray(it->second.vao);
+  glActiveTexture(GL_TEXTURE0);
   glBindTexture(GL_TEXTURE_2D, image.getTexture());
-  glUniform1f(u_sheetsize, sheetsize);
-  glUniform2f(u_scale, scale_x, scale_y);
+  glUniform2f(u_uvscale, image.getU(), image.getV());
+  glUniform2f(u_offset, x, y);
   glUniform2f(u_screensize, screen_w, screen_h);
-  glUniform2f(u_scroll, x, y);
-  glUniform1f(u_tile, tile);
-  glUniform1f(u_angle, angle);
-  glDrawArrays(GL_TRIANGLES, 0, POINTS_PER_TILE);
+  glDrawArraysInstanced(GL_TRIANGLES, 0, POINTS_PER_TILE, it->second.count);
+  drawCalls += 1;
+  spritesDrawn += it->second.count;
+}
+
+void SpriteBatch::endFrame() {
+  flush();
+  if (textBytes > TEXT_CACHE_BYTES) {
+    // oldest first, the text of this frame stays even if it alone is over the size
+    std::vector<decltype(textRuns)::iterator> runs;
+    for (auto it = textRuns.begin(); it != textRuns.end(); ++it) {
+      runs.push_back(it);
+    }
+    std::sort(runs.begin(), runs.end(), [](const auto& a, const auto& b) {
+      return a->second.lastUsed < b->second.lastUsed;
+    });
+    for (auto it : runs) {
+      if (textBytes <= TEXT_CACHE_BYTES || it->second.lastUsed == frame) {
+        break;
+      }
+      glDeleteVertexArrays(1, &it->second.vao);
+      glDeleteBuffers(1, &it->second.buffer);
+      textBytes -= it->second.count * sizeof(Instance);
+      textRuns.erase(it);
+    }
+  }
+  frame += 1;
 }
 
+void SpriteBatch::drawSprite(const Image& image, int x, int y, int tile, int sheetsize, float scale_x, float scale_y, float angle) {
+  if (!instances.empty() && image.getTexture() != texture) {
+    flush();
+  }
+  texture = image.getTexture();
+  u = image.getU();
+  v = image.getV();
+  instances.push_back(Instance{(GLfloat)x, (GLfloat)y, scale_x, scale_y, angle, (GLfloat)tile, (GLfloat)sheetsize});
+}
 
+void SpriteBatch::flush() {
+  if (instances.empty()) {
+    return;
+  }
+  glUseProgram(program);
+  glBindVertexArray(vao);
+  glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+  glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(Instance), instances.data(), GL_STREAM_DRAW);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glUniform2f(u_uvscale, u, v);
+  glUniform2f(u_offset, 0, 0);
+  glUniform2f(u_screensize, screen_w, screen_h);
+  glDrawArraysInstanced(GL_TRIANGLES, 0, POINTS_PER_TILE, instances.size());
+  drawCalls += 1;
+  spritesDrawn += instances.size();
+  instances.clear();
+}
+
+int SpriteSheet::getSheetSize() const {
+  return std::max(1, image.getWidth() / frameWidth);
+}
 
 SpriteSheet::SpriteSheet(const std::string& filename, int frameWidth, int frameHeight)
-  : ownImage(new Image(filename)),
+  : ownImage(ImageCache::getInstance().getAsync(filename)),
     image(*ownImage),
-    sheetSize(image.getWidth()/frameWidth),
     frameWidth(frameWidth),
     frameHeight(frameHeight) {
-  SpriteShader::getInstance();
 }
 
 SpriteSheet::SpriteSheet(const Image& image, int frameWidth, int frameHeight)
   : ownImage(nullptr),
     image(image),
-    sheetSize(image.getWidth()/frameWidth),
     frameWidth(frameWidth),
     frameHeight(frameHeight) {
-  SpriteShader::getInstance();
-}
-
-SpriteSheet::~SpriteSheet() {
-  delete ownImage;
 }
 
 void SpriteSheet::drawSprite(int x, int y, int frame) {
-  SpriteShader::getInstance().drawSprite(image, x, y, frame, sheetSize, frameWidth, frameHeight);
+  SpriteBatch::getInstance().drawSprite(image, x, y, frame, getSheetSize(), frameWidth, frameHeight);
 }
 
 void SpriteSheet::drawSpriteFlipped(int x, int y, int frame) {
-  SpriteShader::getInstance().drawSprite(image, x, y, frame, sheetSize, -frameWidth, frameHeight);
+  SpriteBatch::getInstance().drawSprite(image, x, y, frame, getSheetSize(), -frameWidth, frameHeight);
 }
 
 void SpriteSheet::drawSpriteScaled(int x, int y, int frame, float scale) {
-  SpriteShader::getInstance().drawSprite(image, x, y, frame, sheetSize, frameWidth*scale, frameHeight*scale);
+  SpriteBatch::getInstance().drawSprite(image, x, y, frame, getSheetSize(), frameWidth*scale, frameHeight*scale);
 }
 
 void SpriteSheet::drawSpriteRotated(int x, int y, int frame, float scale) {
-  SpriteShader::getInstance().drawSprite(image, x, y, frame, sheetSize, frameWidth, frameHeight, scale);
+  SpriteBatch::getInstance().drawSprite(image, x, y, frame, getSheetSize(), frameWidth, frameHeight, scale);
 }
 
 void Image::draw(int x, int y, int tw, int th) const {
-  SpriteShader::getInstance().drawSprite(*this, x, y, 0, 1, tw, th, 0);
+  SpriteBatch::getInstance().drawSprite(*this, x, y, 0, 1, tw, th, 0);
 }
 
 
@@ -1,16 +1,38 @@
 #pragma once
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <ostream>
 #include <string>
+#include <tuple>
+#include <vector>
 #include <GLES3/gl3.h>
 
 class string;
 
-unsigned int load_texture(const char* filename, unsigned int filter, int *out_w, int *out_h, float *out_u, float *out_v);
+// Uploads at the image's own size unless pad is set, which pads to the next power of two.
+// out_u, out_v receive the part of the texture covered by the image.
+unsigned int load_texture(const char* filename, unsigned int filter, int *out_w, int *out_h, float *out_u, float *out_v, bool pad = false);
+// Uploads RGBA8 pixels as a new texture, see load_texture.
+unsigned int upload_texture(const unsigned char* rgba, unsigned width, unsigned height, unsigned int filter, float *out_u, float *out_v, bool pad = false);
 void destroy_texture(unsigned int texture);
 
 class Image {
   public:
-    Image(const std::string &filename);
+    Image(const std::string &filename, bool pad = false);
+    // A transparent placeholder of size 0x0 until setPixels is called.
+    Image();
+    ~Image();
+    Image(const Image&) = delete;
+    Image& operator=(const Image&) = delete;
     GLuint getTexture() const { return texture; }
+    // texture coordinates of the image's right and bottom edge, below 1 for padded textures
+    float getU() const { return u; }
+    float getV() const { return v; }
+    // size of the texture in video memory
+    size_t getTextureBytes() const;
+    bool isReady() const { return ready; }
+    void setPixels(const unsigned char* rgba, unsigned width, unsigned height, bool pad = false);
     void draw(int x, int y, int tw, int th) const;
     int getWidth() const { return w; };
     int getHeight() const { return h; };
@@ -18,16 +40,95 @@ class Image {
     GLuint texture;
     int w;
     int h;
+    float u;
+    float v;
+    bool ready;
 };
 
+// Offscreen RGBA texture to render into. While bound, the screen sized pixel coordinates
+// all shaders use are mapped so screen position 0, 0 lands in the target's top left corner.
+class RenderTarget {
+  public:
+    RenderTarget(int width, int height);
+    ~RenderTarget();
+    RenderTarget(const RenderTarget&) = delete;
+    RenderTarget& operator=(const RenderTarget&) = delete;
+    void bind() const;
+    // Back to drawing to the screen.
+    static void unbind();
+    GLuint getTexture() const { return texture; }
+    int getWidth() const { return w; }
+    int getHeight() const { return h; }
+  private:
+    GLuint framebuffer;
+    GLuint texture;
+    int w;
+    int h;
+};
 
+// Shares Images loaded from the same file with the same flags. The cache keeps its own
+// reference, so reopening an asset is free until it gets evicted.
+class ImageCache {
+  public:
+    static ImageCache& getInstance() {
+      static ImageCache instance;
+      return instance;
+    }
+    std::shared_ptr<const Image> get(const std::string& filename, bool pad = false);
+    // Returns a placeholder right away, the file is decoded on a worker and uploaded
+    // by runMainThreadTasks.
+    std::shared_ptr<const Image> getAsync(const std::string& filename, bool pad = false);
+    // Drops the cache's reference, users keep their image until they release it.
+    void evict(const std::string& filename, bool pad = false);
+    // Drops the images nobody but the cache uses.
+    void evictUnused();
+    // Drops every cached image. Call before the GL context goes away, the cache itself
+    // lives until static destruction.
+    void clear() { images.clear(); }
+    size_t getHits() const { return hits; }
+    size_t getMisses() const { return misses; }
+    size_t getResidentBytes() const;
+    void report(std::ostream& os) const;
+  private:
+    ImageCache() {}
+    std::map<std::pair<std::string, bool>, std::shared_ptr<Image>> images;
+    size_t hits = 0;
+    size_t misses = 0;
+};
+
+
+// The map is split into CHUNK_SIZE x CHUNK_SIZE chunks, each holding one tile id per
+// instance. Edits only upload the changed span of their chunk, and drawing skips chunks
+// outside of the screen and, with skipzero, chunks without any tile.
 class Tilemap {
   public:
+    static const int CHUNK_SIZE = 64;
     Tilemap(const Image&, int width, int height, int tile_w, int tile_h, int tile_dx=0, int tile_dy=0, bool skipzero=false);
+    ~Tilemap();
+    Tilemap(const Tilemap&) = delete;
+    Tilemap& operator=(const Tilemap&) = delete;
     void drawTilemap(int x, int y);
     void setAt(int x, int y, int newTile);
+    // Bytes held in vertex buffers.
+    size_t getVertexBytes() const;
+    int getChunksDrawn() const { return chunksDrawn; }
+    int getSheetTiles() const { return sheetSize * sheetSize; }
   private:
-    void rebuild();
+    struct Chunk {
+      int x;
+      int y;
+      int w;
+      int h;
+      GLuint vao;
+      GLuint tileBuffer;
+      std::vector<GLushort> tiles;
+      // Range of tiles changed since the last upload, empty when begin >= end.
+      size_t dirtyBegin;
+      size_t dirtyEnd;
+      // Number of non-zero tiles.
+      int used;
+    };
+    void uploadDirty();
     const Image& image;
     const int width;
     const int height;
@@ -37,26 +138,115 @@ class Tilemap {
     const int tileDy;
     const int sheetSize;
     const bool skipZero;
-    int* grid;
-    bool needRebuild;
+    const int chunksX;
+    std::vector<Chunk> chunks;
+    std::vector<int> dirtyChunks;
+    int chunksDrawn;
+};
+
+// Same interface as Tilemap, but the map is an R16UI texture of tile ids drawn with a
+// single quad; the fragment shader looks up the tile of every pixel. Uses 2 bytes per
+// tile and an edit is a one texel upload.
+class TextureTilemap {
+  public:
+    TextureTilemap(const Image&, int width, int height, int tile_w, int tile_h, int tile_dx=0, int tile_dy=0, bool skipzero=false);
+    ~TextureTilemap();
+    TextureTilemap(const TextureTilemap&) = delete;
+    TextureTilemap& operator=(const TextureTilemap&) = delete;
+    void drawTilemap(int x, int y);
+    void setAt(int x, int y, int newTile);
+    size_t getTextureBytes() const;
+    int getSheetTiles() const { return sheetSize * sheetSize; }
+  private:
+    const Image& image;
+    const int width;
+    const int height;
+    const int tileWidth;
+    const int tileHeight;
+    const int tileDx;
+    const int tileDy;
+    const int sheetSize;
+    const bool skipZero;
+    std::vector<GLushort> tiles;
+    GLuint mapTexture;
+};
+
+class SpriteSheet;
+
+// Collects sprites and draws all consecutive ones sharing a texture with one instanced
+// draw call. Anything drawn outside of the batch has to flush it first to keep the order.
+class SpriteBatch {
+  public:
+    static SpriteBatch& getInstance();
+    void drawSprite(const Image& image, int x, int y, int tile, int sheetsize, float scale_x, float scale_y, float angle = 0.0);
+    void flush();
+    // Text is laid out once into its own instance buffer and drawn with one call at x, y.
+    // The buffer is kept while it fits in TEXT_CACHE_BYTES, GUI elements drawn from a
+    // cached target print only now and then.
+    void drawText(const SpriteSheet& font, int x, int y, const std::string& text, float size);
+    // Drops the least recently drawn text once the cache is over its size.
+    void endFrame();
+    // Drops the text laid out with a texture, called before the texture is deleted so a
+    // new texture getting the same name starts without it.
+    static void releaseTexture(GLuint texture);
+    bool isEmpty() const { return instances.empty(); }
+    int getDrawCalls() const { return drawCalls; }
+    int getSpritesDrawn() const { return spritesDrawn; }
+  private:
+    SpriteBatch();
+    GLuint createVao(GLuint instances);
+    struct Instance {
+      GLfloat x;
+      GLfloat y;
+      GLfloat scaleX;
+      GLfloat scaleY;
+      GLfloat angle;
+      GLfloat tile;
+      GLfloat sheetSize;
+    };
+    struct TextRun {
+      GLuint vao;
+      GLuint buffer;
+      int count;
+      unsigned lastUsed;
+    };
+    static const size_t TEXT_CACHE_BYTES = 1 << 20;
+    std::vector<Instance> instances;
+    // text, size, font texture, frame width and height, frames per row
+    std::map<std::tuple<std::string, float, GLuint, int, int, int>, TextRun> textRuns;
+    size_t textBytes = 0;
+    unsigned frame = 0;
+    GLuint texture = 0;
+    float u = 1;
+    float v = 1;
     GLuint vao;
-    GLuint buffer;
+    GLuint program;
+    GLuint positionBuffer;
+    GLuint texcoordBuffer;
+    GLuint instanceBuffer;
+    GLint u_uvscale;
+    GLint u_offset;
+    GLint u_screensize;
+    int drawCalls = 0;
+    int spritesDrawn = 0;
 };
 
 class SpriteSheet {
   public:
     SpriteSheet(const Image& image, int frame_w, int frame_h);
     SpriteSheet(const std::string&, int frame_w, int frame_h);
-    ~SpriteSheet();
     void drawSprite(int x, int y, int frame);
     void drawSpriteFlipped(int x, int y, int frame);
     void drawSpriteScaled(int x, int y, int frame, float scale);
     void drawSpriteRotated(int x, int y, int frame, float rotation);
-    int getFrameWidth() { return frameWidth; }
+    int getFrameWidth() const { return frameWidth; }
+    int getFrameHeight() const { return frameHeight; }
+    // frames per row, the image may still be loading
+    int getSheetSize() const;
+    const Image& getImage() const { return image; }
   private:
-    const Image* ownImage;
+    std::shared_ptr<const Image> ownImage;
     const Image& image;
-    const int sheetSize;
     const int frameWidth;
     const int frameHeight;
 };
@@ -2,6 +2,7 @@
 #include <iostream>
 #include <string>
 #include <cmath>
+#include <cstddef>
 #include "primitive.h"
 #include "main.h"
 
@@ -46,30 +47,47 @@ static GLuint createProgram(const std::string &vertexShaderSource, const std::st
 PrimitiveShader::PrimitiveShader() : red(1.0), green(1.0), blue(1.0), alpha(1.0), scrollX(0.0), scrollY(0.0) {
   std::string vertexShader = "#version 300 es \n"
     "in vec2 a_position; \n"
-    "uniform vec2 u_scroll; \n"
+    "in vec2 a_texcoord; \n"
+    "in vec4 a_color; \n"
+    "in float a_mode; \n"
     "uniform vec2 u_screensize; \n"
-    "uniform vec2 u_texturePos; \n"
-    "uniform float u_textureScale; \n"
     "out vec2 v_texcoord; \n"
+    "out vec4 v_color; \n"
+    "out float v_mode; \n"
     "void main() { \n"
-    "  vec2 pos = a_position + u_scroll;\n"
-    "  vec2 scaled_pos = ((pos/u_screensize) * 2.0 - 1.0) * vec2(1.0, -1.0); \n"
+    "  vec2 scaled_pos = ((a_position/u_screensize) * 2.0 - 1.0) * vec2(1.0, -1.0); \n"
     "  gl_Position = vec4(scaled_pos, 1.0, 1.0); \n"
-    "  v_texcoord = ((a_position+u_texturePos) / 128.0) * u_textureScale; \n"
+    "  v_texcoord = a_texcoord; \n"
+    "  v_color = a_color; \n"
+    "  v_mode = a_mode; \n"
     "} \n";
   std::string fragmentShader = "#version 300 es \n"
     "precision mediump float; \n"
     "out vec4 outColor; \n"
-    "uniform vec4 u_color; \n"
-    "in vec2 v_texcoord; \n"
+    "in highp vec2 v_texcoord; \n"
+    "in vec4 v_color; \n"
+    "in float v_mode; \n"
     "uniform sampler2D u_texture; \n"
-    "uniform bool u_useTexture; \n"
+    "uniform sampler2D u_palette; \n"
     "void main() { \n"
-    "  if (u_useTexture) { \n"
+    // derivatives are undefined in control flow depending on a varying, so before the branch
+    "  highp vec2 lineWidth = fwidth(v_texcoord); \n"
+    "  if (v_mode > 2.5) { \n"
+    "    highp vec2 cell = fract(v_texcoord); \n"
+    "    if (cell.x >= lineWidth.x && cell.y >= lineWidth.y) { \n"
+    "      discard; \n"
+    "    } \n"
+    "    outColor = v_color; \n"
+    "  } \n"
+    "  else if (v_mode > 1.5) { \n"
+    "    int index = int(texture(u_texture, v_texcoord).r * 255.0 + 0.5); \n"
+    "    outColor = texelFetch(u_palette, ivec2(index, 0), 0);\n"
+    "  } \n"
+    "  else if (v_mode > 0.5) { \n"
     "    outColor = texture(u_texture, v_texcoord);\n"
     "  } \n"
     "  else { \n"
-    "    outColor = u_color; \n"
+    "    outColor = v_color; \n"
     "  } \n"
     "}\n";
 
@@ -78,20 +96,25 @@ PrimitiveShader::PrimitiveShader() : red(1.0), green(1.0), blue(1.0), alpha(1.0)
   glGenVertexArrays(1, &vao);
   glBindVertexArray(vao);
 
-  GLfloat positions[4] = {0,0, 1,1};
-  GLuint a_positionLocation = glGetAttribLocation(program, "a_position");
-  glGenBuffers(1, &positionBuffer);
-  glBindBuffer(GL_ARRAY_BUFFER, positionBuffer);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(positions), positions, GL_DYNAMIC_DRAW);
-  glEnableVertexAttribArray(a_positionLocation);
-  glVertexAttribPointer(a_positionLocation, 2, GL_FLOAT, false, 0, 0);
+  glGenBuffers(1, &vertexBuffer);
+  glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+  GLint a_position = glGetAttribLocation(program, "a_position");
+  GLint a_texcoord = glGetAttribLocation(program, "a_texcoord");
+  GLint a_color = glGetAttribLocation(program, "a_color");
+  GLint a_mode = glGetAttribLocation(program, "a_mode");
+  glEnableVertexAttribArray(a_position);
+  glVertexAttribPointer(a_position, 2, GL_FLOAT, false, sizeof(Vertex), (void*)offsetof(Vertex, x));
+  glEnableVertexAttribArray(a_texcoord);
+  glVertexAttribPointer(a_texcoord, 2, GL_FLOAT, false, sizeof(Vertex), (void*)offsetof(Vertex, u));
+  glEnableVertexAttribArray(a_color);
+  glVertexAttribPointer(a_color, 4, GL_FLOAT, false, sizeof(Vertex), (void*)offsetof(Vertex, r));
+  glEnableVertexAttribArray(a_mode);
+  glVertexAttribPointer(a_mode, 1, GL_FLOAT, false, sizeof(Vertex), (void*)offsetof(Vertex, mode));
 
-  u_scroll = glGetUniformLocation(program, "u_scroll");
   u_screensize = glGetUniformLocation(program, "u_screensize");
-  u_color = glGetUniformLocation(program, "u_color");
-  u_useTexture = glGetUniformLocation(program, "u_useTexture");
-  u_textureScale = glGetUniformLocation(program, "u_textureScale");
-  u_texturePos = glGetUniformLocation(program, "u_texturePos");
+  // image texture is bound to unit 0, palette texture to unit 1
+  glUniform1i(glGetUniformLocation(program, "u_texture"), 0);
+  glUniform1i(glGetUniformLocation(program, "u_palette"), 1);
 }
 
 
@@ -116,95 +139,153 @@ void PrimitiveShader::setScale(float s) {
   scale = s;
 }
 
+void PrimitiveShader::setTexture(GLuint newTexture) {
+  if (newTexture != texture && batchUsesTexture) {
+    flush();
+  }
+  texture = newTexture;
+}
+
+void PrimitiveShader::setPaletteTexture(GLuint newTexture) {
+  if (newTexture != paletteTexture && batchUsesTexture) {
+    flush();
+  }
+  paletteTexture = newTexture;
+}
+
+void PrimitiveShader::setClip(int x, int y, int w, int h) {
+  flush();
+  glScissor(x, (targetHeight ? targetHeight : screen_h) - y - h, w, h);
+  glEnable(GL_SCISSOR_TEST);
+}
+
+void PrimitiveShader::clearClip() {
+  flush();
+  glDisable(GL_SCISSOR_TEST);
+}
+
+void PrimitiveShader::beginPrimitive(GLenum primitive, Mode mode) {
+  if (primitive != batchPrimitive) {
+    flush();
+    batchPrimitive = primitive;
+  }
+  currentMode = mode;
+  if (mode == MODE_TEXTURE || mode == MODE_PALETTE) {
+    batchUsesTexture = true;
+  }
+}
+
+void PrimitiveShader::addVertex(float x, float y, float u, float v) {
+  batch.push_back(Vertex{(x + scrollX) / scale, (y + scrollY) / scale, u, v, red, green, blue, alpha, (GLfloat)currentMode});
+}
+
+void PrimitiveShader::flush() {
+  if (batch.empty()) {
+    return;
+  }
+  glUseProgram(program);
+  glBindVertexArray(vao);
+  glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+  glBufferData(GL_ARRAY_BUFFER, batch.size() * sizeof(Vertex), batch.data(), GL_STREAM_DRAW);
+  glUniform2f(u_screensize, screen_w, screen_h);
+  if (batchUsesTexture) {
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, paletteTexture);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, texture);
+  }
+  glDrawArrays(batchPrimitive, 0, batch.size());
+  batch.clear();
+  batchUsesTexture = false;
+}
+
 
 void PrimitiveShader::drawLine(float x0, float y0, float x1, float y1) {
-  GLfloat positions[4] = {x0,y0, x1,y1};
-  glBindBuffer(GL_ARRAY_BUFFER, positionBuffer);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(positions), positions, GL_DYNAMIC_DRAW);
-  executeDraw(GL_LINES, 2);
+  beginPrimitive(GL_LINES, MODE_COLOR);
+  addVertex(x0, y0);
+  addVertex(x1, y1);
 }
 
 void PrimitiveShader::drawRectangle(float x0, float y0, float x1, float y1) {
-  GLfloat positions[12] = {x0,y0, x1,y0, x0,y1,  x1,y0, x0,y1, x1,y1};
-  glBindBuffer(GL_ARRAY_BUFFER, positionBuffer);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(positions), positions, GL_DYNAMIC_DRAW);
-  executeDraw(GL_TRIANGLES, 6);
+  beginPrimitive(GL_TRIANGLES, MODE_COLOR);
+  addVertex(x0, y0);
+  addVertex(x1, y0);
+  addVertex(x0, y1);
+  addVertex(x1, y0);
+  addVertex(x0, y1);
+  addVertex(x1, y1);
 }
 
 void PrimitiveShader::drawConvexPolygon(const std::vector<float>& points, float texture_scale, float texture_pos_x, float texture_pos_y) {
-  const GLfloat* positions = points.data();
-  glBindBuffer(GL_ARRAY_BUFFER, positionBuffer);
-  glBufferData(GL_ARRAY_BUFFER, points.size() * sizeof(float), positions, GL_DYNAMIC_DRAW);
-  glUseProgram(program);
-  glBindVertexArray(vao);
-  glUniform2f(u_screensize, screen_w*scale, screen_h*scale);
-  glUniform4f(u_color, red, green, blue, alpha);
-  glUniform2f(u_scroll, scrollX, scrollY);
-  glUniform1f(u_textureScale, texture_scale);
-  glUniform2f(u_texturePos, texture_pos_x, texture_pos_y);
-  glUniform1i(u_useTexture, 1);
-  glDrawArrays(GL_TRIANGLES, 0, points.size()/2);
+  beginPrimitive(GL_TRIANGLES, MODE_TEXTURE);
+  for (size_t i = 0; i + 1 < points.size(); i += 2) {
+    float x = points[i];
+    float y = points[i+1];
+    addVertex(x, y, ((x + texture_pos_x) / 128.0) * texture_scale, ((y + texture_pos_y) / 128.0) * texture_scale);
+  }
 }
 
 void PrimitiveShader::drawCircleOutline(float x0, float y0, float r) {
   const int detail = 16;
-  GLfloat positions[detail*2];
+  beginPrimitive(GL_LINES, MODE_COLOR);
   for (int i=0; i<detail; i++) {
-    float f = (i/(float)detail) * 2 * M_PI;
-    float x = x0 + sin(f) * r;
-    float y = y0 + cos(f) * r;
-    positions[i*2+0] = x;
-    positions[i*2+1] = y;
+    float f0 = (i/(float)detail) * 2 * M_PI;
+    float f1 = ((i+1)/(float)detail) * 2 * M_PI;
+    addVertex(x0 + sin(f0) * r, y0 + cos(f0) * r);
+    addVertex(x0 + sin(f1) * r, y0 + cos(f1) * r);
   }
-  glBindBuffer(GL_ARRAY_BUFFER, positionBuffer);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(positions), positions, GL_DYNAMIC_DRAW);
-  executeDraw(GL_LINE_LOOP, detail);
 }
 
 void PrimitiveShader::drawCircle(float x0, float y0, float r) {
   const int detail = 16;
-  GLfloat positions[(detail+1)*2];
+  beginPrimitive(GL_TRIANGLES, MODE_COLOR);
   for (int i=0; i<detail; i++) {
-    float f = (i/(float)detail) * 2 * M_PI;
-    float x = x0 + sin(f) * r;
-    float y = y0 + cos(f) * r;
-    positions[i*2+0] = x;
-    positions[i*2+1] = y;
+    float f0 = (i/(float)detail) * 2 * M_PI;
+    float f1 = ((i+1)/(float)detail) * 2 * M_PI;
+    addVertex(x0, y0);
+    addVertex(x0 + sin(f0) * r, y0 + cos(f0) * r);
+    addVertex(x0 + sin(f1) * r, y0 + cos(f1) * r);
   }
-  positions[detail*2+0] = x0;
-  positions[detail*2+1] = y0;
-  glBindBuffer(GL_ARRAY_BUFFER, positionBuffer);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(positions), positions, GL_DYNAMIC_DRAW);
-  executeDraw(GL_TRIANGLE_FAN, detail+1);
 }
 
-void PrimitiveShader::drawTexture(float x0, float y0, float w, float h, float targetW, float targetH) {
-    GLfloat x1 = x0 + w;
-    GLfloat y1 = y0 + h;
-    GLfloat positions[12] = {x0,y0, x1,y0, x0,y1,  x1,y0, x0,y1, x1,y1};
-    glBindBuffer(GL_ARRAY_BUFFER, positionBuffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(positions), positions, GL_DYNAMIC_DRAW);
-
-    glUseProgram(program);
-    glBindVertexArray(vao);
-    glUniform2f(u_scroll, scrollX, scrollY);
-    glUniform2f(u_screensize, screen_w*scale, screen_h*scale);
-    glUniform4f(u_color, red, green, blue, alpha);
-    glUniform1i(u_useTexture, 1);
+void PrimitiveShader::drawTexture(float x0, float y0, float w, float h) {
+  beginPrimitive(GL_TRIANGLES, MODE_TEXTURE);
+  addTexturedQuad(x0, y0, w, h);
+}
 
-    glUniform1f(u_textureScale, 128 / ((w/targetW)*targetW));
-    glUniform2f(u_texturePos, -x0, -y0);
+void PrimitiveShader::drawPaletteTexture(float x0, float y0, float w, float h) {
+  beginPrimitive(GL_TRIANGLES, MODE_PALETTE);
+  addTexturedQuad(x0, y0, w, h);
+}
 
-    glDrawArrays(GL_TRIANGLES, 0, 6);
+void PrimitiveShader::drawFlippedTexture(float x0, float y0, float w, float h) {
+  beginPrimitive(GL_TRIANGLES, MODE_TEXTURE);
+  addTexturedQuad(x0, y0, w, h, 1, 0);
 }
 
-void PrimitiveShader::executeDraw(int primitive, int numVertex, bool useTexture) {
-  glUseProgram(program);
-  glBindVertexArray(vao);
-  glUniform2f(u_scroll, scrollX, scrollY);
-  glUniform2f(u_screensize, screen_w*scale, screen_h*scale);
-  glUniform4f(u_color, red, green, blue, alpha);
-  glUniform1i(u_useTexture, useTexture);
-  glDrawArrays(primitive, 0, numVertex);
+void PrimitiveShader::addTexturedQuad(float x0, float y0, float w, float h, float v0, float v1) {
+  float x1 = x0 + w;
+  float y1 = y0 + h;
+  addVertex(x0, y0, 0, v0);
+  addVertex(x1, y0, 1, v0);
+  addVertex(x0, y1, 0, v1);
+  addVertex(x1, y0, 1, v0);
+  addVertex(x0, y1, 0, v1);
+  addVertex(x1, y1, 1, v1);
 }
 
+void PrimitiveShader::drawGrid(float x0, float y0, float cellW, float cellH, int columns, int rows) {
+  // one quad, the fragment shader keeps the first screen pixel of every cell;
+  // it extends by a pixel so the closing lines on the right and bottom get drawn too
+  float x1 = x0 + columns * cellW + 1;
+  float y1 = y0 + rows * cellH + 1;
+  float u1 = columns + 1 / cellW;
+  float v1 = rows + 1 / cellH;
+  beginPrimitive(GL_TRIANGLES, MODE_GRID);
+  addVertex(x0, y0, 0, 0);
+  addVertex(x1, y0, u1, 0);
+  addVertex(x0, y1, 0, v1);
+  addVertex(x1, y0, u1, 0);
+  addVertex(x0, y1, 0, v1);
+  addVertex(x1, y1, u1, v1);
+}
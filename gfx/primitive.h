@@ -2,6 +2,9 @@
 #include <GLES3/gl3.h>
 #include <vector>
 
+// Primitives are not drawn right away: vertices (with color and scroll already applied)
+// are appended to a CPU side batch which is drawn with a single call whenever the
+// state changes (primitive type, texture, clip rect) or on flush().
 class PrimitiveShader {
   public:
     PrimitiveShader();
@@ -9,23 +12,54 @@ class PrimitiveShader {
     void setScroll(int x, int y);
     void addScroll(int x, int y);
     void setScale(float scale);
+    // texture sampled by drawTexture/drawConvexPolygon, or the R8 index texture for drawPaletteTexture
+    void setTexture(GLuint texture);
+    // 256x1 RGBA texture used to resolve indices in drawPaletteTexture
+    void setPaletteTexture(GLuint texture);
+    // clip rect in screen coordinates, origin in the top left corner
+    void setClip(int x, int y, int w, int h);
+    // Height of the framebuffer drawn to when it is not the screen, 0 for the screen.
+    void setTargetHeight(int height) { targetHeight = height; }
+    void clearClip();
     void drawLine(float x0, float y0, float x1, float y1);
     void drawRectangle(float x0, float y0, float x1, float y1);
-    void drawTexture(float x0, float y0, float x1, float y1, float targetW, float targetH);
+    // the whole texture stretched over w x h
+    void drawTexture(float x0, float y0, float w, float h);
+    void drawPaletteTexture(float x0, float y0, float w, float h);
+    // drawTexture for textures rendered to, which have their first row at the bottom
+    void drawFlippedTexture(float x0, float y0, float w, float h);
     void drawConvexPolygon(const std::vector<float>& points, float textureScale, float texture_x, float texture_y);
     void drawCircle(float x, float y, float r);
     void drawCircleOutline(float x, float y, float r);
+    // lines around columns x rows cells of cellW x cellH, drawn as a single quad
+    void drawGrid(float x0, float y0, float cellW, float cellH, int columns, int rows);
+    void flush();
   private:
-    void executeDraw(int primitive, int numVertex, bool useTexture = false);
+    enum Mode { MODE_COLOR = 0, MODE_TEXTURE = 1, MODE_PALETTE = 2, MODE_GRID = 3 };
+    struct Vertex {
+      GLfloat x;
+      GLfloat y;
+      GLfloat u;
+      GLfloat v;
+      GLfloat r;
+      GLfloat g;
+      GLfloat b;
+      GLfloat a;
+      GLfloat mode;
+    };
+    void beginPrimitive(GLenum primitive, Mode mode);
+    void addVertex(float x, float y, float u = 0.0, float v = 0.0);
+    void addTexturedQuad(float x0, float y0, float w, float h, float v0 = 0.0, float v1 = 1.0);
     GLuint program;
     GLuint vao;
-    GLuint positionBuffer;
-    GLuint u_useTexture;
-    GLuint u_scroll;
-    GLuint u_screensize;
-    GLuint u_textureScale;
-    GLuint u_texturePos;
-    GLuint u_color;
+    GLuint vertexBuffer;
+    GLint u_screensize;
+    std::vector<Vertex> batch;
+    GLenum batchPrimitive = GL_TRIANGLES;
+    Mode currentMode = MODE_COLOR;
+    bool batchUsesTexture = false;
+    GLuint texture = 0;
+    GLuint paletteTexture = 0;
     float red;
     float green;
     float blue;
@@ -33,5 +67,5 @@ class PrimitiveShader {
     int scrollX;
     int scrollY;
     float scale = 1.0;
+    int targetHeight = 0;
 };
-
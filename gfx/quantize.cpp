@@ -0,0 +1,290 @@
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+#include "quantize.h"
+#include "parallel.h"
+
+static const int BITS = 5;
+static const int LEVELS = 1 << BITS;
+static const int BINS = LEVELS * LEVELS * LEVELS;
+
+struct Bin {
+  uint64_t count;
+  uint64_t r;
+  uint64_t g;
+  uint64_t b;
+};
+
+struct Box {
+  int lo[3];
+  int hi[3]; // inclusive
+  uint64_t count;
+};
+
+static inline int binIndex(int r, int g, int b) {
+  return ((r >> (8 - BITS)) << (2 * BITS)) | ((g >> (8 - BITS)) << BITS) | (b >> (8 - BITS));
+}
+
+static inline int binAt(const int c[3]) {
+  return (c[0] << (2 * BITS)) | (c[1] << BITS) | c[2];
+}
+
+static inline int clampByte(int value) {
+  return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+static uint64_t boxCount(const std::vector<Bin>& histogram, const Box& box) {
+  uint64_t count = 0;
+  int c[3];
+  for (c[0] = box.lo[0]; c[0] <= box.hi[0]; ++c[0]) {
+    for (c[1] = box.lo[1]; c[1] <= box.hi[1]; ++c[1]) {
+      for (c[2] = box.lo[2]; c[2] <= box.hi[2]; ++c[2]) {
+        count += histogram[binAt(c)].count;
+      }
+    }
+  }
+  return count;
+}
+
+// Shrinks the box to the bins that are actually populated.
+static void shrink(const std::vector<Bin>& histogram, Box& box) {
+  int lo[3] = {LEVELS, LEVELS, LEVELS};
+  int hi[3] = {-1, -1, -1};
+  int c[3];
+  for (c[0] = box.lo[0]; c[0] <= box.hi[0]; ++c[0]) {
+    for (c[1] = box.lo[1]; c[1] <= box.hi[1]; ++c[1]) {
+      for (c[2] = box.lo[2]; c[2] <= box.hi[2]; ++c[2]) {
+        if (histogram[binAt(c)].count) {
+          for (int axis = 0; axis < 3; ++axis) {
+            lo[axis] = std::min(lo[axis], c[axis]);
+            hi[axis] = std::max(hi[axis], c[axis]);
+          }
+        }
+      }
+    }
+  }
+  if (hi[0] >= 0) {
+    std::copy(lo, lo + 3, box.lo);
+    std::copy(hi, hi + 3, box.hi);
+  }
+}
+
+// Splits along the longest side at the pixel median, returns false if the box is a single bin.
+static bool split(const std::vector<Bin>& histogram, Box& box, Box& other) {
+  int axis = 0;
+  for (int i = 1; i < 3; ++i) {
+    if (box.hi[i] - box.lo[i] > box.hi[axis] - box.lo[axis]) {
+      axis = i;
+    }
+  }
+  if (box.hi[axis] == box.lo[axis]) {
+    return false;
+  }
+  std::vector<uint64_t> slices(LEVELS, 0);
+  int c[3];
+  for (c[0] = box.lo[0]; c[0] <= box.hi[0]; ++c[0]) {
+    for (c[1] = box.lo[1]; c[1] <= box.hi[1]; ++c[1]) {
+      for (c[2] = box.lo[2]; c[2] <= box.hi[2]; ++c[2]) {
+        slices[c[axis]] += histogram[binAt(c)].count;
+      }
+    }
+  }
+  uint64_t half = box.count / 2;
+  uint64_t sum = 0;
+  int cut = box.lo[axis];
+  for (; cut < box.hi[axis] - 1; ++cut) {
+    sum += slices[cut];
+    if (sum >= half) {
+      break;
+    }
+  }
+  other = box;
+  box.hi[axis] = cut;
+  other.lo[axis] = cut + 1;
+  box.count = boxCount(histogram, box);
+  other.count = box.count <= other.count ? other.count - box.count : 0;
+  shrink(histogram, box);
+  shrink(histogram, other);
+  return true;
+}
+
+static std::vector<Bin> buildHistogram(const unsigned char* rgba, unsigned width, unsigned height) {
+  int bands = std::max(1, std::min(workerCount(), (int)height / 64));
+  std::vector<std::vector<Bin>> partial(bands, std::vector<Bin>(BINS, Bin{0, 0, 0, 0}));
+  parallelBands(bands, [&](int first, int last) {
+    for (int band = first; band < last; ++band) {
+      std::vector<Bin>& histogram = partial[band];
+      size_t begin = (size_t)width * (height * band / bands);
+      size_t end = (size_t)width * (height * (band + 1) / bands);
+      for (size_t i = begin; i < end; ++i) {
+        const unsigned char* p = rgba + i * 4;
+        Bin& bin = histogram[binIndex(p[0], p[1], p[2])];
+        bin.count++;
+        bin.r += p[0];
+        bin.g += p[1];
+        bin.b += p[2];
+      }
+    }
+  }, 1);
+  for (int band = 1; band < bands; ++band) {
+    for (int i = 0; i < BINS; ++i) {
+      partial[0][i].count += partial[band][i].count;
+      partial[0][i].r += partial[band][i].r;
+      partial[0][i].g += partial[band][i].g;
+      partial[0][i].b += partial[band][i].b;
+    }
+  }
+  return std::move(partial[0]);
+}
+
+static std::vector<uint32_t> medianCut(const std::vector<Bin>& histogram, int maxColors) {
+  std::vector<Box> boxes;
+  Box all{{0, 0, 0}, {LEVELS - 1, LEVELS - 1, LEVELS - 1}, 0};
+  all.count = boxCount(histogram, all);
+  shrink(histogram, all);
+  boxes.push_back(all);
+  while ((int)boxes.size() < maxColors) {
+    // split the most populated box that still spans more than one bin
+    int best = -1;
+    uint64_t bestScore = 0;
+    for (size_t i = 0; i < boxes.size(); ++i) {
+      const Box& box = boxes[i];
+      int extent = std::max({box.hi[0] - box.lo[0], box.hi[1] - box.lo[1], box.hi[2] - box.lo[2]});
+      uint64_t score = box.count * extent;
+      if (extent > 0 && score > bestScore) {
+        best = i;
+        bestScore = score;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    Box other;
+    if (!split(histogram, boxes[best], other)) {
+      break;
+    }
+    boxes.push_back(other);
+  }
+  std::vector<uint32_t> palette;
+  for (const Box& box : boxes) {
+    uint64_t count = 0, r = 0, g = 0, b = 0;
+    int c[3];
+    for (c[0] = box.lo[0]; c[0] <= box.hi[0]; ++c[0]) {
+      for (c[1] = box.lo[1]; c[1] <= box.hi[1]; ++c[1]) {
+        for (c[2] = box.lo[2]; c[2] <= box.hi[2]; ++c[2]) {
+          const Bin& bin = histogram[binAt(c)];
+          count += bin.count;
+          r += bin.r;
+          g += bin.g;
+          b += bin.b;
+        }
+      }
+    }
+    if (count == 0) {
+      continue;
+    }
+    palette.push_back((r / count) | ((g / count) << 8) | ((b / count) << 16) | (0xffu << 24));
+  }
+  return palette;
+}
+
+// Nearest palette entry for the center of every histogram bin.
+static std::vector<unsigned char> buildLookup(const std::vector<uint32_t>& palette) {
+  std::vector<unsigned char> lookup(BINS);
+  parallelBands(BINS, [&](int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+      int r = ((i >> (2 * BITS)) << (8 - BITS)) + (1 << (7 - BITS));
+      int g = (((i >> BITS) & (LEVELS - 1)) << (8 - BITS)) + (1 << (7 - BITS));
+      int b = ((i & (LEVELS - 1)) << (8 - BITS)) + (1 << (7 - BITS));
+      int best = 0;
+      int bestDistance = 1 << 30;
+      for (size_t j = 0; j < palette.size(); ++j) {
+        int dr = r - (int)(palette[j] & 0xff);
+        int dg = g - (int)((palette[j] >> 8) & 0xff);
+        int db = b - (int)((palette[j] >> 16) & 0xff);
+        int distance = dr * dr * 2 + dg * dg * 4 + db * db * 3;
+        if (distance < bestDistance) {
+          best = j;
+          bestDistance = distance;
+        }
+      }
+      lookup[i] = best;
+    }
+  }, 1024);
+  return lookup;
+}
+
+static void remap(const unsigned char* rgba, unsigned width, int y0, int y1, const std::vector<unsigned char>& lookup, unsigned char* indices) {
+  for (size_t i = (size_t)y0 * width; i < (size_t)y1 * width; ++i) {
+    const unsigned char* p = rgba + i * 4;
+    indices[i] = lookup[binIndex(p[0], p[1], p[2])];
+  }
+}
+
+static void remapOrdered(const unsigned char* rgba, unsigned width, int y0, int y1, const std::vector<unsigned char>& lookup, unsigned char* indices) {
+  static const int bayer[4][4] = {{0, 8, 2, 10}, {12, 4, 14, 6}, {3, 11, 1, 9}, {15, 7, 13, 5}};
+  const int step = 1 << (8 - BITS);
+  for (int y = y0; y < y1; ++y) {
+    for (unsigned x = 0; x < width; ++x) {
+      size_t i = (size_t)y * width + x;
+      const unsigned char* p = rgba + i * 4;
+      // spread the threshold over one histogram bin
+      int offset = (bayer[y & 3][x & 3] * step) / 16 - step / 2;
+      indices[i] = lookup[binIndex(clampByte(p[0] + offset), clampByte(p[1] + offset), clampByte(p[2] + offset))];
+    }
+  }
+}
+
+static void remapFloydSteinberg(const unsigned char* rgba, unsigned width, int y0, int y1, const std::vector<unsigned char>& lookup,
+                         const std::vector<uint32_t>& palette, unsigned char* indices) {
+  // error rows are in 1/16 units with one pixel of padding on both sides
+  std::vector<int> current((width + 2) * 3, 0);
+  std::vector<int> next((width + 2) * 3, 0);
+  for (int y = y0; y < y1; ++y) {
+    std::fill(next.begin(), next.end(), 0);
+    for (unsigned x = 0; x < width; ++x) {
+      size_t i = (size_t)y * width + x;
+      const unsigned char* p = rgba + i * 4;
+      int* error = &current[(x + 1) * 3];
+      int r = clampByte(p[0] + error[0] / 16);
+      int g = clampByte(p[1] + error[1] / 16);
+      int b = clampByte(p[2] + error[2] / 16);
+      unsigned char index = lookup[binIndex(r, g, b)];
+      indices[i] = index;
+      uint32_t color = palette[index];
+      int diff[3] = {r - (int)(color & 0xff), g - (int)((color >> 8) & 0xff), b - (int)((color >> 16) & 0xff)};
+      for (int c = 0; c < 3; ++c) {
+        current[(x + 2) * 3 + c] += diff[c] * 7;
+        next[x * 3 + c] += diff[c] * 3;
+        next[(x + 1) * 3 + c] += diff[c] * 5;
+        next[(x + 2) * 3 + c] += diff[c];
+      }
+    }
+    current.swap(next);
+  }
+}
+
+void quantize_image(const unsigned char* rgba, unsigned width, unsigned height, int maxColors, Dither dither,
+                    std::vector<uint32_t>& palette, unsigned char* indices) {
+  maxColors = std::max(1, std::min(maxColors, 256));
+  std::vector<Bin> histogram = buildHistogram(rgba, width, height);
+  palette = medianCut(histogram, maxColors);
+  if (palette.empty()) {
+    palette.push_back(0xff000000);
+  }
+  std::vector<unsigned char> lookup = buildLookup(palette);
+  parallelBands(height, [&](int y0, int y1) {
+    switch (dither) {
+      case Dither::None:
+        remap(rgba, width, y0, y1, lookup, indices);
+        break;
+      case Dither::Ordered:
+        remapOrdered(rgba, width, y0, y1, lookup, indices);
+        break;
+      case Dither::FloydSteinberg:
+        remapFloydSteinberg(rgba, width, y0, y1, lookup, palette, indices);
+        break;
+    }
+  });
+}
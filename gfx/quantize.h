@@ -0,0 +1,15 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+enum class Dither {
+  None,
+  Ordered,        // 4x4 Bayer matrix
+  FloydSteinberg, // error diffusion, restarted at every band boundary
+};
+
+// Reduces an RGBA8 image to at most maxColors colors with median cut on a 15 bit
+// histogram. palette receives the colors packed as 0xAABBGGRR, indices gets one
+// byte per pixel so maxColors is clamped to 256. Alpha is ignored.
+void quantize_image(const unsigned char* rgba, unsigned width, unsigned height, int maxColors, Dither dither,
+                    std::vector<uint32_t>& palette, unsigned char* indices);
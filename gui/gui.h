@@ -1,6 +1,7 @@
 #pragma once
 
 #include <functional>
+#include <memory>
 
 class GuiMenu;
 class GuiElement {
@@ -50,6 +51,7 @@ class GuiElement {
                 if (guiElementDragging) {
                     mX += dx;
                     mY += dy;
+                    markDirty();
                     handled = true;
                 } else {
                     y -= 10;
@@ -69,6 +71,29 @@ class GuiElement {
             }
         }
         virtual void guiEventDraw();
+        // Call when anything the element draws changed.
+        void markDirty() { mDirty = true; }
+        // Whether the element or one of its children has to be drawn again. Elements showing
+        // state they do not own override it to compare against what they drew last.
+        virtual bool needsRedraw() {
+            if (mDirty) {
+                return true;
+            }
+            for (auto element : childElements) {
+                if (element->needsRedraw()) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        // Marks the whole tree dirty and drops the cached renderings.
+        void invalidate() {
+            mDirty = true;
+            mCache.reset();
+            for (auto element : childElements) {
+                element->invalidate();
+            }
+        }
         virtual void guiEventMouseWheel(int x, int y, int value) {
             x -= getX();
             y -= getY();
@@ -98,7 +123,11 @@ class GuiElement {
         bool hasBorder = false;
         std::string title = "";
         std::function<void(void)> onClick;
+        // Keeps the element's rendering in an offscreen target, only redrawn when it
+        // needs a redraw; meant for top level elements that change rarely.
+        bool cacheRendering = false;
     protected:
+        void drawElement();
         int mX;
         int mY;
         int mW;
@@ -107,6 +136,8 @@ class GuiElement {
         bool guiElementDragging{false};
         std::vector<GuiElement*> childElements;
         GuiMenu* mMenu = nullptr;
+        bool mDirty = true;
+        std::unique_ptr<RenderTarget> mCache;
 };
 
 
@@ -190,6 +221,29 @@ class GuiMenu : public GuiElement {
 };
 
 void GuiElement::guiEventDraw() {
+    if (!cacheRendering) {
+        drawElement();
+        return;
+    }
+    // border, title bar and menu are drawn outside of the element's size
+    int w = std::min(std::max(mW, getWidth()) + 2, screen_w);
+    int h = std::min(std::max(mH, getHeight()) + 2 + (hasTitleBar ? 16 : 0) + (mMenu ? 24 : 0), screen_h);
+    if (!mCache || mCache->getWidth() != w || mCache->getHeight() != h) {
+        mCache.reset(new RenderTarget(w, h));
+        mDirty = true;
+    }
+    if (needsRedraw()) {
+        mCanvas->beginTarget(*mCache);
+        mCanvas->pushScroll();
+        mCanvas->setScroll(-mX, -mY);
+        drawElement();
+        mCanvas->popScroll();
+        mCanvas->endTarget();
+    }
+    mCanvas->drawTarget(*mCache, mX, mY);
+}
+
+void GuiElement::drawElement() {
     mCanvas->pushScroll();
     mCanvas->addScroll(mX, mY);
     if (hasBorder) {
@@ -220,4 +274,5 @@ void GuiElement::guiEventDraw() {
     }
     draw();
     mCanvas->popScroll();
+    mDirty = false;
 }
@@ -0,0 +1,99 @@
+#include <unordered_set>
+#include "history.h"
+
+void History::beginStep() {
+    if (mInStep) {
+        endStep();
+    }
+    mInStep = true;
+    mStepPalette = mBitmap->palette;
+    mBitmap->beginRecording();
+}
+
+void History::endStep() {
+    if (!mInStep) {
+        return;
+    }
+    mInStep = false;
+    Step step;
+    step.tiles = mBitmap->endRecording();
+    if (mStepPalette != mBitmap->palette) {
+        step.hasPalette = true;
+        step.palette = mStepPalette;
+    }
+    if (step.tiles.empty() && !step.hasPalette) {
+        return;
+    }
+    mUndo.push_back(std::move(step));
+    if (mUndo.size() > mMaxSteps) {
+        mUndo.pop_front();
+    }
+    mRedo.clear();
+}
+
+bool History::undo() {
+    endStep();
+    if (mUndo.empty()) {
+        return false;
+    }
+    apply(mUndo.back());
+    mRedo.push_back(std::move(mUndo.back()));
+    mUndo.pop_back();
+    return true;
+}
+
+bool History::redo() {
+    endStep();
+    if (mRedo.empty()) {
+        return false;
+    }
+    apply(mRedo.back());
+    mUndo.push_back(std::move(mRedo.back()));
+    mRedo.pop_back();
+    return true;
+}
+
+void History::clear() {
+    if (mInStep) {
+        mBitmap->endRecording();
+        mInStep = false;
+    }
+    mUndo.clear();
+    mRedo.clear();
+}
+
+void History::apply(Step& step) {
+    for (auto& entry : step.tiles) {
+        mBitmap->swapTile(entry.first, entry.second);
+    }
+    if (step.hasPalette) {
+        std::swap(mBitmap->palette, step.palette);
+    }
+}
+
+size_t History::getResidentBytes() const {
+    std::unordered_set<const Bitmap::Tile*> tiles;
+    size_t bytes = 0;
+    for (const auto* steps : {&mUndo, &mRedo}) {
+        for (const Step& step : *steps) {
+            bytes += sizeof(Step) + step.tiles.size() * sizeof(step.tiles[0]);
+            if (step.hasPalette) {
+                bytes += step.palette.size() * (sizeof(uint32_t) + sizeof(Color));
+            }
+            for (const auto& entry : step.tiles) {
+                if (entry.second) {
+                    tiles.insert(entry.second.get());
+                }
+            }
+        }
+    }
+    return bytes + tiles.size() * sizeof(Bitmap::Tile);
+}
+
+void History::report(std::ostream& os) const {
+    os << "History: " << mUndo.size() << " undo / " << mRedo.size() << " redo steps, "
+       << getResidentBytes() / 1024 << " KB held, bitmap "
+       << mBitmap->getWidth() << "x" << mBitmap->getHeight() << " with "
+       << mBitmap->getAllocatedTiles() << " tiles allocated" << std::endl;
+}
+
@@ -0,0 +1,40 @@
+#pragma once
+#include <deque>
+#include <iostream>
+#include "bitmap.h"
+
+// Undo/redo for a Bitmap and its Palette. A step only keeps the tiles that were written
+// during it, shared with the bitmap until either side changes them, so memory grows
+// with the edited area rather than with the image size.
+class History {
+    public:
+        History(Bitmap* bitmap, size_t maxSteps = 1000)
+            : mBitmap(bitmap), mMaxSteps(maxSteps) {}
+        // Everything changed between beginStep and endStep is undone as one step.
+        void beginStep();
+        void endStep();
+        bool undo();
+        bool redo();
+        // Needed whenever the bitmap gets replaced, e.g. after loading.
+        void clear();
+        size_t getUndoSteps() const { return mUndo.size(); }
+        size_t getRedoSteps() const { return mRedo.size(); }
+        // Bytes of tile and palette data owned by the history.
+        size_t getResidentBytes() const;
+        void report(std::ostream& os) const;
+    private:
+        struct Step {
+            Bitmap::TileList tiles;
+            bool hasPalette = false;
+            Palette palette;
+        };
+        // Swaps the step's content with the bitmap, so applying it again reverts it.
+        void apply(Step& step);
+        Bitmap* mBitmap;
+        size_t mMaxSteps;
+        bool mInStep = false;
+        Palette mStepPalette;
+        // the oldest undo step is dropped at the front once maxSteps is reached
+        std::deque<Step> mUndo;
+        std::deque<Step> mRedo;
+};
@@ -1,11 +1,17 @@
 #include <fstream>
 #include <sstream>
 #include <map>
+#include <chrono>
 #include <GLES3/gl3.h>
 #include "sys/main.h"
+#include "sys/jobs.h"
 #include "gfx/canvas.h"
 #include "gfx/gfx.h"
 #include "gfx/lodepng.h"
+#include "gfx/expand.h"
+#include "bitmap.h"
+#include "history.h"
+#include "stroke.h"
 #include "glm/gtc/matrix_transform.hpp"
 #include "gui/gui.h"
 
@@ -14,137 +20,7 @@ bool modAlt = false;
 bool modShift = false;
 
 Canvas* canvas;
-
-typedef uint8_t Pixel;
-
-struct Color {
-    float r;
-    float g;
-    float b;
-    static Color fromHex(const std::string& hexString) {
-        float r = stoi(hexString.substr(1, 2), nullptr, 16) / 255.0;
-        float g = stoi(hexString.substr(3, 2), nullptr, 16) / 255.0;
-        float b = stoi(hexString.substr(5, 2), nullptr, 16) / 255.0;
-        return Color{r, g, b};
-    }
-    bool operator==(const Color& other) const { return this->r == other.r && this->g == other.g && this->b == other.b; }
-};
-
-class Palette {
-    public:
-        Palette() {
-        }
-        size_t size() { return lut.size(); }
-        void setSize(int newSize) { lut.resize(newSize); }
-        Color getColor(Pixel index) { return lut[index]; }
-        void setColor(Pixel index, Color color) { lut[index] = color; }
-        Pixel addColor(Color color) {
-            auto codeIt = std::find(lut.begin(), lut.end(), color);
-            if (codeIt != lut.end()) {
-                return codeIt - lut.begin();
-            }
-            lut.push_back(color);
-            return lut.size() -1;
-        }
-    private:
-    public:
-        std::vector<Color> lut;
-};
-
-class Bitmap {
-    public:
-        Bitmap() {
-            width = 1;
-            height = 1;
-            data.resize(width * height);
-            for (int y = 0; y < height; ++y) {
-                for (int x = 0; x < width; ++x) {
-                    pixelAt(x, y) = 0;
-                }
-            }
-        }
-        Pixel& pixelAt(int x, int y) {
-            return data[x + y * width];
-        }
-        int getWidth() { return width; }
-        int getHeight() { return height; }
-        unsigned int loadpng(const std::string& filename);
-        unsigned int loadXpm2(const std::string& filename);
-
-        Palette palette;
-    private:
-        std::vector<Pixel> data;
-        unsigned int width;
-        unsigned int height;
-};
-
-
-unsigned int Bitmap::loadpng(const std::string& filename) {
-    std::vector<unsigned char> image;
-    unsigned error = lodepng::decode(image, width, height, filename);
-    if(error != 0)
-    {
-        std::cout << "error " << error << ": " << lodepng_error_text(error) << std::endl;
-        return 1;
-    }
-    data.resize(width * height);
-    for(size_t i = 0; i < height * width; i++) {
-        Color color{
-            (image[i*4 + 0])/255.0f,
-            (image[i*4 + 1])/255.0f,
-            (image[i*4 + 2])/255.0f,
-        };
-        auto index = palette.addColor(color);
-        data[i] = index;
-    }
-    return 0;
-}
-
-unsigned int Bitmap::loadXpm2(const std::string& filename)
-{
-    std::ifstream file;
-    file.open(filename.c_str());
-    std::string magic;
-    std::getline(file, magic);
-    if (magic != "! XPM2") {
-        std::cout << "not xpm2" << std::endl;
-        return 1;
-    }
-    int colors;
-    int cpp; // characters per pixel
-    file >> width;
-    file >> height;
-    file >> colors;
-    file >> cpp;
-    std::vector<std::string> codes;
-    palette.setSize(colors);
-    for (int i = 0; i < colors; ++i) {
-        std::string code;
-        std::string type;
-        std::string hexColor;
-        file >> code >> type >> hexColor;
-        codes.push_back(code);
-        auto color = Color::fromHex(hexColor);
-        palette.setColor(i, color);
-    }
-    std::string line;
-    data.resize(width * height);
-    int dataIndex = 0;
-    while (std::getline(file, line)) {
-        for (int i = 0; i < line.size() / cpp; ++i) {
-            std::string code = line.substr(i*cpp, cpp);
-            auto codeIt = std::find(codes.begin(), codes.end(), code);
-            int paletteIndex = 0;
-            if (codeIt != codes.end()) {
-                paletteIndex = codeIt - codes.begin();
-            }
-            data[dataIndex] = paletteIndex;
-            dataIndex += 1;
-        }
-    }
-    file.close();
-    return 0;
-}
+History* history = nullptr;
 
 class ImageViewMini : public GuiElement {
     public:
@@ -167,80 +43,218 @@ class ImageView : public GuiElement {
             , mImage(image)
             , mSelectedIndex(selectedIndex)
             , mAltIndex(altIndex)
+            , mStroke(image)
         {
             glGenTextures(1, &textureId);
             glBindTexture(GL_TEXTURE_2D, textureId);
             glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
             glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glGenTextures(1, &paletteTextureId);
+            glBindTexture(GL_TEXTURE_2D, paletteTextureId);
+            glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            updatePaletteTexture();
             updateTexture();
         }
         int getWidth() override { return mPixelSize * mImage->getWidth(); }
         int getHeight() override { return mPixelSize * mImage->getHeight(); }
         void mousePressed(bool pressed, int button, int x, int y) override {
+            if (mLoading) {
+                return;
+            }
+            if (!pressed && mStroke.isActive()) {
+                mStroke.end();
+                history->endStep();
+                return;
+            }
             if (modCtrl) {
                 // control enables color picker
                 int px = x / mPixelSize;
                 int py = y / mPixelSize;
-                auto newIndex = mImage->pixelAt(px, py);
+                if (!mImage->contains(px, py)) {
+                    return;
+                }
+                auto newIndex = mImage->getPixel(px, py);
                 if (button == 1) {
                     mSelectedIndex = newIndex;
                 } else {
                     mAltIndex = newIndex;
                 }
-            } else {
-                mPainting = pressed;
-                mPaintIndex = (button == 1 ? mSelectedIndex : mAltIndex);
-                mouseMove(x, y, 0, 0);
+            } else if (pressed && mTool == Tool::Fill) {
+                fill(toImage(x), toImage(y), (button == 1 ? mSelectedIndex : mAltIndex));
+            } else if (pressed) {
+                // every press-drag-release is one undo step
+                history->beginStep();
+                mStroke.begin(toImage(x), toImage(y), (button == 1 ? mSelectedIndex : mAltIndex), mBrushSize);
+                mStroke.flush();
             }
         }
         void mouseMove(int x, int y, int dx, int dy) override {
-            if (mPainting) {
-                x /= mPixelSize;
-                y /= mPixelSize;
-                mImage->pixelAt(x, y) = mPaintIndex;
-                textureOutOfDate = true;
+            if (!mStroke.isActive()) {
+                return;
+            }
+            if (mouse_samples.empty()) {
+                mStroke.lineTo(toImage(x), toImage(y));
+            } else {
+                // x, y is the last sample, the earlier ones have the same offset to the view
+                int offsetX = mouse_x - x;
+                int offsetY = mouse_y - y;
+                for (const MouseSample& sample : mouse_samples) {
+                    mStroke.lineTo(toImage(sample.x - offsetX), toImage(sample.y - offsetY));
+                }
+            }
+            mStroke.flush();
+        }
+        enum class Tool { Brush, Fill };
+        void setTool(Tool tool) { mTool = tool; }
+        void fill(int x, int y, Pixel index) {
+            if (!mImage->contains(x, y)) {
+                return;
+            }
+            history->beginStep();
+            mImage->floodFill(x, y, index);
+            history->endStep();
+        }
+        // Shows a placeholder instead of the bitmap while it is being replaced.
+        void setLoading(bool loading) {
+            mLoading = loading;
+            markDirty();
+        }
+        void setBrushSize(int size) { mBrushSize = std::max(size, 1); }
+        int getBrushSize() { return mBrushSize; }
+        void setIndexedRendering(bool indexed) {
+            mIndexedRendering = indexed;
+            textureOutOfDate = true;
+            markDirty();
+        }
+        bool isIndexedRendering() { return mIndexedRendering; }
+        bool needsRedraw() override {
+            if (mLoading) {
+                return GuiElement::needsRedraw();
             }
+            return GuiElement::needsRedraw() || mImage->hasDirtyTiles() || !mPendingTiles.empty()
+                || mImage->palette.getVersion() != mPaletteVersion;
         }
+        // Pushes the bitmap's dirty tiles to the texture, reallocating it only when the
+        // size or format changed. At most UPLOAD_BUDGET bytes go up per call, the rest
+        // waits for the next frames so opening a large image doesn't stall one frame.
         void updateTexture() {
             int w = mImage->getWidth();
             int h = mImage->getHeight();
-            uint8_t* data = new uint8_t[w * h * 4];
-            for (int y = 0; y < h; ++y) {
-                for (int x = 0; x < w; ++x) {
-                    auto pixel = mImage->pixelAt(x, y);
-                    auto color = mImage->palette.getColor(pixel);
-                    data[(y * w + x)*4 + 0] = color.r * 255;
-                    data[(y * w + x)*4 + 1] = color.g * 255;
-                    data[(y * w + x)*4 + 2] = color.b * 255;
-                    data[(y * w + x)*4 + 3] = 255;
+            std::vector<int> dirty = mImage->takeDirtyTiles();
+            if (textureOutOfDate || w != mTextureWidth || h != mTextureHeight) {
+                glBindTexture(GL_TEXTURE_2D, textureId);
+                if (mIndexedRendering) {
+                    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, w, h, 0, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+                } else {
+                    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+                }
+                mTextureWidth = w;
+                mTextureHeight = h;
+                textureOutOfDate = false;
+                dirty.resize(mImage->getTilesX() * mImage->getTilesY());
+                for (size_t i = 0; i < dirty.size(); ++i) {
+                    dirty[i] = i;
                 }
+                mPendingTiles.clear();
+            }
+            if (!dirty.empty()) {
+                // a tile dirtied again while waiting goes up once
+                mPendingTiles.insert(mPendingTiles.end(), dirty.begin(), dirty.end());
+                std::sort(mPendingTiles.begin(), mPendingTiles.end());
+                mPendingTiles.erase(std::unique(mPendingTiles.begin(), mPendingTiles.end()), mPendingTiles.end());
+            }
+            if (mPendingTiles.empty()) {
+                return;
             }
+            size_t tileBytes = Bitmap::TILE_SIZE * Bitmap::TILE_SIZE * (mIndexedRendering ? 1 : 4);
+            size_t count = std::min(mPendingTiles.size(), std::max<size_t>(1, UPLOAD_BUDGET / tileBytes));
             glBindTexture(GL_TEXTURE_2D, textureId);
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, &data[0]);
-            delete[] data;
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, Bitmap::TILE_SIZE);
+            for (size_t i = 0; i < count; ++i) {
+                if (mIndexedRendering) {
+                    uploadIndexTile(mPendingTiles[i]);
+                } else {
+                    uploadRgbaTile(mPendingTiles[i]);
+                }
+            }
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            mPendingTiles.erase(mPendingTiles.begin(), mPendingTiles.begin() + count);
+            if (!mPendingTiles.empty()) {
+                requestRedraw();
+            }
+        }
+        void uploadIndexTile(int tileIndex) {
+            // indices go up as they are, the palette lookup happens in the fragment shader
+            Rect rect = mImage->tileRect(tileIndex);
+            const Bitmap::Tile* tile = mImage->getTile(tileIndex);
+            const Pixel* pixels;
+            if (tile) {
+                pixels = tile->pixels;
+            } else {
+                mStaging.assign(Bitmap::TILE_SIZE * Bitmap::TILE_SIZE, mImage->getFillIndex());
+                pixels = mStaging.data();
+            }
+            glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x0, rect.y0, rect.width(), rect.height(), GL_RED, GL_UNSIGNED_BYTE, pixels);
+        }
+        void uploadRgbaTile(int tileIndex) {
+            Rect rect = mImage->tileRect(tileIndex);
+            const Bitmap::Tile* tile = mImage->getTile(tileIndex);
+            // staging buffer is kept between uploads, the palette LUT is the one last uploaded
+            const int count = Bitmap::TILE_SIZE * Bitmap::TILE_SIZE;
+            mRgbaStaging.resize(count);
+            if (tile) {
+                expand_indices(tile->pixels, count, mPaletteCache.data(), mRgbaStaging.data());
+            } else {
+                std::fill(mRgbaStaging.begin(), mRgbaStaging.end(), mPaletteCache[mImage->getFillIndex()]);
+            }
+            glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x0, rect.y0, rect.width(), rect.height(), GL_RGBA, GL_UNSIGNED_BYTE, mRgbaStaging.data());
+        }
+        // Uploads the palette as a 256x1 texture, returns false if nothing changed since last upload.
+        bool updatePaletteTexture() {
+            if (mImage->palette.getVersion() == mPaletteVersion) {
+                return false;
+            }
+            mPaletteVersion = mImage->palette.getVersion();
+            mPaletteCache.resize(256);
+            mImage->palette.packLut(mPaletteCache.data());
+            glBindTexture(GL_TEXTURE_2D, paletteTextureId);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 256, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, mPaletteCache.data());
+            return true;
         }
 
         void draw() override {
-            glScissor(20, screen_h - mH - mY, mW, mH);
-            glEnable(GL_SCISSOR_TEST);
-            if (textureOutOfDate) {
-                updateTexture();
-                textureOutOfDate = false;
+            canvas->setClip(0, 0, mW, mH);
+            if (mLoading) {
+                canvas->setColor(0.5, 0.5, 0.5);
+                canvas->drawRectangle(0, 0, mW, mH);
+                canvas->print(Point{16, 16}, "Loading...");
+                canvas->clearClip();
+                return;
+            }
+            if (updatePaletteTexture() && !mIndexedRendering) {
+                // rgba mode has the colors baked into the image texture
+                textureOutOfDate = true;
             }
+            updateTexture();
             int w = mImage->getWidth();
             int h = mImage->getHeight();
-            glBindTexture(GL_TEXTURE_2D, textureId);
-            canvas->drawTexture(0, 0, w*mPixelSize, h*mPixelSize, w, h);
-            canvas->drawTexture(w*mPixelSize, 0, w*4, h*4, w, h);
-            canvas->drawTexture(w*mPixelSize + w*4, 0, w, h, w, h);
-            canvas->setColor(0,0,0);
-            for (int y = 0; y <= h; ++y) {
-                canvas->drawLine(0, y * mPixelSize, w * mPixelSize, y * mPixelSize);
-            }
-            for (int x = 0; x <= w; ++x) {
-                canvas->drawLine(x * mPixelSize, 0, x * mPixelSize, h * mPixelSize);
+            canvas->setTexture(textureId);
+            if (mIndexedRendering) {
+                canvas->setPaletteTexture(paletteTextureId);
+                canvas->drawPaletteTexture(0, 0, w*mPixelSize, h*mPixelSize);
+                canvas->drawPaletteTexture(w*mPixelSize, 0, w*4, h*4);
+                canvas->drawPaletteTexture(w*mPixelSize + w*4, 0, w, h);
+            } else {
+                canvas->drawTexture(0, 0, w*mPixelSize, h*mPixelSize);
+                canvas->drawTexture(w*mPixelSize, 0, w*4, h*4);
+                canvas->drawTexture(w*mPixelSize + w*4, 0, w, h);
             }
-            glDisable(GL_SCISSOR_TEST);
+            canvas->setColor(0,0,0);
+            canvas->drawGrid(0, 0, mPixelSize, mPixelSize, w, h);
+            canvas->clearClip();
         }
         void mouseWheel(int x, int y, int value) {
             if (value > 0) {
@@ -249,16 +263,40 @@ class ImageView : public GuiElement {
                 zoomOut();
             }
         }
-        void zoomIn() { mPixelSize += 1; }
-        void zoomOut() { mPixelSize -= 1; }
+        void zoomIn() {
+            mPixelSize += 1;
+            markDirty();
+        }
+        void zoomOut() {
+            mPixelSize -= 1;
+            markDirty();
+        }
     private:
+        // View to image coordinates, rounding down so points left of or above the
+        // image stay outside of it.
+        int toImage(int v) {
+            return (v < 0 ? v - mPixelSize + 1 : v) / mPixelSize;
+        }
         Bitmap* mImage;
         int& mSelectedIndex;
         int& mAltIndex;
+        Stroke mStroke;
+        Tool mTool = Tool::Brush;
+        bool mLoading = false;
         int mPixelSize = 8;
-        int mPaintIndex = 0;
-        bool mPainting = false;
+        int mBrushSize = 1;
         GLuint textureId;
+        GLuint paletteTextureId;
+        int mTextureWidth = 0;
+        int mTextureHeight = 0;
+        static const size_t UPLOAD_BUDGET = 8 << 20;
+        // tiles still to upload, sorted
+        std::vector<int> mPendingTiles;
+        std::vector<uint8_t> mStaging;
+        std::vector<uint32_t> mRgbaStaging;
+        std::vector<uint32_t> mPaletteCache;
+        uint64_t mPaletteVersion = 0;
+        bool mIndexedRendering = true;
         bool textureOutOfDate = true;
 };
 
@@ -274,10 +312,19 @@ class PaletteView : public GuiElement {
         }
         int getWidth() override { return mPaletteEntrySize; }
         int getHeight() override { return mPaletteEntrySize * mPalette->size(); }
+        bool needsRedraw() override {
+            return GuiElement::needsRedraw() || mPalette->getVersion() != mDrawnVersion
+                || mSelectedIndex != mDrawnSelected || mAltIndex != mDrawnAlt;
+        }
         void mousePressed(bool pressed, int button, int x, int y) override {
             int newIndex = y / mPaletteEntrySize;
             if (modCtrl) {
                 std::cout << "Now starting adjusting" << std::endl;
+                if (pressed) {
+                    history->beginStep();
+                } else {
+                    history->endStep();
+                }
                 mAdjusting = pressed;
                 mAdjustingIndex = newIndex;
                 mAdjustingOrigin = Point{(double)x, (double)y};
@@ -300,6 +347,9 @@ class PaletteView : public GuiElement {
             }
         }
         void draw() override {
+            mDrawnVersion = mPalette->getVersion();
+            mDrawnSelected = mSelectedIndex;
+            mDrawnAlt = mAltIndex;
             for (int i = 0; i < mPalette->size(); ++i) {
                 auto color = mPalette->getColor(i);
                 const int paletteEntrySize = 50;
@@ -316,7 +366,7 @@ class PaletteView : public GuiElement {
                 mCanvas->drawRectangle(
                         0, 0,
                         paletteEntrySize, paletteEntrySize);
-                mCanvas->setColor(color.r, color.g, color.b);
+                mCanvas->setColor(color.r, color.g, color.b, color.a);
                 mCanvas->drawRectangle(
                         border, border,
                         paletteEntrySize-border, paletteEntrySize-border);
@@ -333,6 +383,9 @@ class PaletteView : public GuiElement {
         bool mAdjusting = false;
         int mAdjustingIndex = 0;
         Point mAdjustingOrigin{0, 0};
+        uint64_t mDrawnVersion = 0;
+        int mDrawnSelected = -1;
+        int mDrawnAlt = -1;
 };
 
 GuiElement* gui;
@@ -343,6 +396,24 @@ PaletteView* paletteView = nullptr;
 int selectedIndex = 1;
 int altIndex = 0;
 
+// Decodes on a worker thread, the bitmap is swapped in on the main thread once done.
+void openImage(const std::string& filename) {
+    imageView->setLoading(true);
+    submitJob([filename] {
+        auto loaded = std::make_shared<Bitmap>();
+        bool xpm = filename.size() > 5 && filename.compare(filename.size() - 5, 5, ".xpm2") == 0;
+        unsigned int error = xpm ? loaded->loadXpm2(filename) : loaded->loadpng(filename);
+        // the swap is cheap, ImageView::updateTexture spreads the upload over frames
+        runOnMainThread([loaded, error] {
+            if (error == 0) {
+                *image = std::move(*loaded);
+                history->clear();
+            }
+            imageView->setLoading(false);
+        });
+    });
+}
+
 void key_press(bool pressed, unsigned char key, unsigned short code) {
     std::cout << "key_pressed " << (int) key << ", " << (int) code << std::endl;
     if (code == 224 || code == 228) {
@@ -354,6 +425,27 @@ void key_press(bool pressed, unsigned char key, unsigned short code) {
     if (code == 226 || code == 230) {
         modAlt = pressed;
     }
+    if (pressed && key == 'i') {
+        imageView->setIndexedRendering(!imageView->isIndexedRendering());
+    }
+    if (pressed && key == 'b') {
+        imageView->setTool(ImageView::Tool::Brush);
+    }
+    if (pressed && key == 'f') {
+        imageView->setTool(ImageView::Tool::Fill);
+    }
+    if (pressed && key == ']') {
+        imageView->setBrushSize(imageView->getBrushSize() + 1);
+    }
+    if (pressed && key == '[') {
+        imageView->setBrushSize(imageView->getBrushSize() - 1);
+    }
+    if (pressed && modCtrl && (key == 'z' || key == 'y')) {
+        bool changed = (key == 'z' ? history->undo() : history->redo());
+        if (changed) {
+            history->report(std::cout);
+        }
+    }
 }
 
 void mouse_button(bool pressed, int button, int x, int y ) {
@@ -371,13 +463,29 @@ void mouse_wheel(int value) {
 void joy_button(bool pressed, int button) {
 }
 
+void gameUpdate() {
+    // the editor only changes on input, nothing runs on a timer
+}
+
 bool gameLoop() {
+    // nothing is drawn while idle, the cached elements are composited when something changed
+    if (gui->needsRedraw()) {
+        requestRedraw();
+    }
+    if (!beginFrame()) {
+        return true;
+    }
+    if (isFullRedraw()) {
+        gui->invalidate();
+    }
     glClear(GL_COLOR_BUFFER_BIT);
     gui->guiEventDraw();
+    canvas->endFrame();
     return true;
 }
 
 void gameInit() {
+  auto start = std::chrono::steady_clock::now();
   const int w = 1600;
   const int h  = (w/16.0)*9.0;
   createWindow(w, h, PROJECT_NAME);
@@ -389,10 +497,11 @@ void gameInit() {
                227/225.0 * 0.5, 1.0);
   canvas = new Canvas;
   image = new Bitmap;
-  //image->loadXpm2("data/test.xpm2");
-  image->loadpng("data/brick.png");
-  //image->loadpng("data/smallFont.png");
+  history = new History(image);
   imageView = new ImageView(canvas, 10, 0, 450, 450, image, selectedIndex, altIndex);
+  openImage("data/brick.png");
+  //openImage("data/test.xpm2");
+  //openImage("data/smallFont.png");
   paletteView = new PaletteView(canvas, screen_w - 10 -50, 10, &image->palette, selectedIndex, altIndex);
   gui = new GuiElement(canvas, 0, 0, screen_w, screen_h);
   gui->addElement(imageView);
@@ -401,6 +510,8 @@ void gameInit() {
   auto fileMenu = mainMenu->addMenu("File");
   fileMenu->addItem("Quit", [](){});
   gui->addMenu(mainMenu);
+  // the image view changes with every stroke and already draws from its own texture
+  paletteView->cacheRendering = true;
 
   auto toolbar = new GuiElement(canvas, 500, 100, 8 + 32 + 8 + 32 + 8, 16 + 8 + 32 + 8);
   toolbar->hasBorder = true;
@@ -413,14 +524,23 @@ void gameInit() {
   auto buttonB = new GuiButton(canvas, 8+32+8, 8, 32, 32, "-");
   buttonB->onClick = []{ imageView->zoomOut(); };
   toolbar->addElement(buttonB);
+  toolbar->cacheRendering = true;
   gui->addElement(toolbar);
+  std::chrono::duration<double> startupTime = std::chrono::steady_clock::now() - start;
+  std::cout << "Startup took " << startupTime.count() * 1000 << " ms" << std::endl;
 }
 
 void gameCleanup() {
+    // no loads may finish while things are torn down
+    shutdownJobs();
     delete gui;
     delete paletteView;
     delete imageView;
+    delete history;
     delete image;
     delete canvas;
+    ImageCache::getInstance().report(std::cout);
+    ImageCache::getInstance().clear();
+    reportFrameStats(std::cout);
 }
 
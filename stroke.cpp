@@ -0,0 +1,60 @@
+#include <cstdlib>
+#include "stroke.h"
+
+void Stroke::begin(int x, int y, Pixel index, int brushSize) {
+    mActive = true;
+    mIndex = index;
+    mBrushSize = std::max(brushSize, 1);
+    mStamps.clear();
+    stamp(x, y);
+    mLastX = x;
+    mLastY = y;
+}
+
+void Stroke::lineTo(int x, int y) {
+    if (!mActive || (x == mLastX && y == mLastY)) {
+        return;
+    }
+    // the start point was stamped by the previous segment
+    int dx = std::abs(x - mLastX);
+    int dy = -std::abs(y - mLastY);
+    int stepX = mLastX < x ? 1 : -1;
+    int stepY = mLastY < y ? 1 : -1;
+    int error = dx + dy;
+    int px = mLastX;
+    int py = mLastY;
+    while (px != x || py != y) {
+        int error2 = 2 * error;
+        if (error2 >= dy) {
+            error += dy;
+            px += stepX;
+        }
+        if (error2 <= dx) {
+            error += dx;
+            py += stepY;
+        }
+        stamp(px, py);
+    }
+    mLastX = x;
+    mLastY = y;
+}
+
+Rect Stroke::flush() {
+    if (mStamps.empty()) {
+        return Rect{0, 0, 0, 0};
+    }
+    Rect changed = mBitmap->fillRects(mStamps, mIndex);
+    mStamps.clear();
+    return changed;
+}
+
+void Stroke::end() {
+    flush();
+    mActive = false;
+}
+
+void Stroke::stamp(int x, int y) {
+    int x0 = x - (mBrushSize - 1) / 2;
+    int y0 = y - (mBrushSize - 1) / 2;
+    mStamps.push_back(Rect{x0, y0, x0 + mBrushSize, y0 + mBrushSize});
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <vector>
+#include "bitmap.h"
+
+// Turns a mouse path into square brush stamps. Consecutive points are joined with
+// Bresenham lines so fast strokes have no gaps, and points landing on the pixel that
+// was stamped last are dropped, so the cost follows the pixels covered rather than
+// the rate of input events. Queued stamps reach the bitmap together on flush.
+class Stroke {
+    public:
+        Stroke(Bitmap* bitmap) : mBitmap(bitmap) {}
+        void begin(int x, int y, Pixel index, int brushSize);
+        // Queues the segment from the previous point to x, y.
+        void lineTo(int x, int y);
+        // Writes the queued stamps and returns the area they changed.
+        Rect flush();
+        void end();
+        bool isActive() const { return mActive; }
+    private:
+        void stamp(int x, int y);
+        Bitmap* mBitmap;
+        bool mActive = false;
+        Pixel mIndex = 0;
+        int mBrushSize = 1;
+        int mLastX = 0;
+        int mLastY = 0;
+        std::vector<Rect> mStamps;
+};
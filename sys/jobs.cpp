@@ -0,0 +1,183 @@
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "jobs.h"
+#include "parallel.h"
+
+struct MainThreadTask {
+  std::function<void()> task;
+  size_t cost;
+};
+
+static std::mutex mainThreadMutex;
+static std::deque<MainThreadTask> mainThreadTasks;
+static std::atomic<int> pending{0};
+
+#ifndef __EMSCRIPTEN__
+class JobPool {
+  public:
+    JobPool() {
+      // one core is left to the main thread
+      int threads = std::max(1, workerCount() - 1);
+      for (int i = 0; i < threads; ++i) {
+        workers.emplace_back([this] { work(); });
+      }
+    }
+    ~JobPool() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+      }
+      wakeup.notify_all();
+      for (auto& worker : workers) {
+        worker.join();
+      }
+    }
+    void submit(std::function<void()> job) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+      }
+      wakeup.notify_one();
+    }
+  private:
+    void work() {
+      while (true) {
+        std::function<void()> job;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          wakeup.wait(lock, [this] { return stopping || !jobs.empty(); });
+          if (stopping) {
+            return;
+          }
+          job = std::move(jobs.front());
+          jobs.pop_front();
+        }
+        job();
+        pending -= 1;
+      }
+    }
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    bool stopping = false;
+};
+#endif
+
+#ifndef __EMSCRIPTEN__
+// Created on first use, so tools that never submit a job start no threads.
+static std::mutex poolMutex;
+static std::unique_ptr<JobPool> pool;
+// Set by shutdownJobs, jobs submitted after it are dropped instead of starting a new pool.
+static bool poolStopped = false;
+#endif
+
+void submitJob(std::function<void()> job) {
+#ifndef __EMSCRIPTEN__
+  std::lock_guard<std::mutex> lock(poolMutex);
+  if (poolStopped) {
+    return;
+  }
+#endif
+  pending += 1;
+#ifdef __EMSCRIPTEN__
+  runOnMainThread([job] {
+    job();
+    pending -= 1;
+  });
+#else
+  if (!pool) {
+    pool.reset(new JobPool());
+  }
+  pool->submit(std::move(job));
+#endif
+}
+
+void runOnMainThread(std::function<void()> task, size_t cost) {
+  pending += 1;
+  std::lock_guard<std::mutex> lock(mainThreadMutex);
+  mainThreadTasks.push_back(MainThreadTask{std::move(task), cost});
+}
+
+void runMainThreadTasks(size_t budget) {
+  size_t spent = 0;
+  while (true) {
+    MainThreadTask next;
+    {
+      std::lock_guard<std::mutex> lock(mainThreadMutex);
+      if (mainThreadTasks.empty() || (spent > 0 && spent + mainThreadTasks.front().cost > budget)) {
+        return;
+      }
+      next = std::move(mainThreadTasks.front());
+      mainThreadTasks.pop_front();
+    }
+    next.task();
+    pending -= 1;
+    spent += std::max<size_t>(next.cost, 1);
+  }
+}
+
+int pendingJobs() {
+  return pending;
+}
+
+void shutdownJobs() {
+#ifndef __EMSCRIPTEN__
+  std::unique_ptr<JobPool> stopped;
+  {
+    std::lock_guard<std::mutex> lock(poolMutex);
+    stopped = std::move(pool);
+    poolStopped = true;
+  }
+  // joins the workers, a job still running may queue one more main thread task. Bands it
+  // submits are dropped, parallelBands runs the unclaimed ones on the calling thread.
+  stopped.reset();
+#endif
+  std::deque<MainThreadTask> dropped;
+  {
+    std::lock_guard<std::mutex> lock(mainThreadMutex);
+    dropped.swap(mainThreadTasks);
+  }
+  pending = 0;
+}
+
+void parallelBands(int count, const std::function<void(int, int)>& body, int minBand) {
+  int bands = std::min(workerCount(), std::max(1, count / minBand));
+  if (bands <= 1) {
+    body(0, count);
+    return;
+  }
+  // Workers and the caller claim bands until none are left, so the caller only ever
+  // waits for bands already running and a call from a busy pool cannot deadlock.
+  struct Bands {
+    std::atomic<int> next{0};
+    int done = 0;
+    std::mutex mutex;
+    std::condition_variable finished;
+  };
+  auto state = std::make_shared<Bands>();
+  auto run = [state, bands, count, &body] {
+    while (true) {
+      int band = state->next++;
+      if (band >= bands) {
+        return;
+      }
+      body(count * band / bands, count * (band + 1) / bands);
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (++state->done == bands) {
+        state->finished.notify_all();
+      }
+    }
+  };
+  for (int i = 1; i < bands; ++i) {
+    submitJob(run);
+  }
+  run();
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->finished.wait(lock, [&] { return state->done == bands; });
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+
+// Background jobs, and the queue for work that has to happen on the main thread like GL
+// uploads. Without threads (web build) jobs run on the main thread between frames.
+void submitJob(std::function<void()> job);
+// cost counts against the per frame budget of runMainThreadTasks, in bytes uploaded.
+void runOnMainThread(std::function<void()> task, size_t cost = 0);
+// Runs queued main thread tasks until their cost reaches budget, at least one per call.
+void runMainThreadTasks(size_t budget);
+// Jobs and main thread tasks not finished yet.
+int pendingJobs();
+// Waits for running jobs, drops queued ones and the main thread tasks not run yet. Jobs
+// submitted afterwards are dropped. Call on exit while the GL context is still there,
+// dropped tasks may release textures.
+void shutdownJobs();
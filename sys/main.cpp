@@ -1,7 +1,9 @@
 #include <GLES3/gl3.h>
+#include <algorithm>
 #include <iostream>
 
 #include "main.h"
+#include "jobs.h"
 
 int screen_w = 600;
 int screen_h = 450;
@@ -11,10 +13,125 @@ bool mouse_left = false;
 bool mouse_right = false;
 int joy_x = 0;
 int joy_y = 0;
+std::vector<MouseSample> mouse_samples;
+int motion_start_x = 0;
+int motion_start_y = 0;
+
+// Bytes of finished loads uploaded per frame, more would show up as a dropped frame.
+const size_t UPLOAD_BUDGET = 8 << 20;
+
+// The first frame is always drawn.
+bool redraw_pending = true;
+bool full_redraw_pending = true;
+bool full_redraw = false;
+bool frame_drawn = false;
+
+// Fixed update rate, gameUpdate runs this many ms apart.
+const int UPDATE_STEP = 10;
+// Steps run in one frame at most, after longer stalls or idle waits the time is dropped.
+const int MAX_UPDATES = 5;
+int update_time = 0;
+
+// Time of the oldest input event not shown yet, -1 if there is none.
+int input_time = -1;
+int stats_frames = 0;
+long long stats_frame_time = 0;
+int stats_max_frame_time = 0;
+int stats_latency_samples = 0;
+long long stats_latency = 0;
+int stats_max_latency = 0;
 
 void startMainLoop();
 bool processInput();
 
+// Called by the backends for every motion event.
+void queueMouseMotion(int x, int y) {
+  if (mouse_samples.empty()) {
+    motion_start_x = mouse_x;
+    motion_start_y = mouse_y;
+  }
+  mouse_x = x;
+  mouse_y = y;
+  mouse_samples.push_back(MouseSample{x, y});
+}
+
+// Delivers the queued motion as a single mouse_move, backends call it once per frame
+// and before button events so the order of motion and clicks is kept.
+void flushMouseMotion() {
+  if (mouse_samples.empty()) {
+    return;
+  }
+  mouse_move(mouse_x - motion_start_x, mouse_y - motion_start_y);
+  mouse_samples.clear();
+}
+
+void requestRedraw(bool full) {
+  redraw_pending = true;
+  full_redraw_pending = full_redraw_pending || full;
+}
+
+bool beginFrame() {
+  if (!redraw_pending) {
+    return false;
+  }
+  full_redraw = full_redraw_pending;
+  redraw_pending = false;
+  full_redraw_pending = false;
+  frame_drawn = true;
+  return true;
+}
+
+bool isFullRedraw() {
+  return full_redraw;
+}
+
+// Whether the last processFrame drew anything, the backends only present frames that did.
+bool frameDrawn() {
+  return frame_drawn;
+}
+
+// Called by the backends for every input event with the time it happened.
+void noteInput(int timestamp) {
+  if (input_time < 0 || timestamp < input_time) {
+    input_time = timestamp;
+  }
+}
+
+// Called by the backends once a drawn frame was presented.
+void framePresented(int start, int end) {
+  stats_frames++;
+  stats_frame_time += end - start;
+  stats_max_frame_time = std::max(stats_max_frame_time, end - start);
+  if (input_time >= 0) {
+    stats_latency_samples++;
+    stats_latency += end - input_time;
+    stats_max_latency = std::max(stats_max_latency, end - input_time);
+    input_time = -1;
+  }
+}
+
+void reportFrameStats(std::ostream& os) {
+  os << "Frames presented: " << stats_frames;
+  if (stats_frames > 0) {
+    os << ", frame time avg " << (double)stats_frame_time / stats_frames << " ms, max " << stats_max_frame_time << " ms";
+  }
+  if (stats_latency_samples > 0) {
+    os << ", input latency avg " << (double)stats_latency / stats_latency_samples << " ms, max " << stats_max_latency << " ms";
+  }
+  os << std::endl;
+}
+
+void runUpdates() {
+  int now = getTick();
+  if (now - update_time > UPDATE_STEP * MAX_UPDATES) {
+    update_time = now - UPDATE_STEP;
+  }
+  while (now - update_time >= UPDATE_STEP) {
+    gameUpdate();
+    update_time += UPDATE_STEP;
+  }
+}
+
 int main(int, char**) {
   gameInit();
   startMainLoop();
@@ -26,7 +143,15 @@ bool processFrame() {
   if (!processInput()) {
     return false;
   }
-  return gameLoop();
+  runMainThreadTasks(UPLOAD_BUDGET);
+  runUpdates();
+  frame_drawn = false;
+  bool running = gameLoop();
+  if (!frame_drawn) {
+    // input that changed nothing on screen has no latency to measure
+    input_time = -1;
+  }
+  return running;
 }
 
 
@@ -1,4 +1,6 @@
 #pragma once
+#include <iosfwd>
+#include <vector>
 
 // Exports - implemnted in main.cpp
 extern int screen_w;
@@ -10,12 +12,31 @@ extern bool mouse_right;
 extern int joy_x;
 extern int joy_y;
 extern bool keys[];
+// Motion reported between two mouse_move calls, oldest first. The backends coalesce all
+// motion of a frame into one mouse_move, code that needs the whole path reads it here.
+struct MouseSample {
+  int x;
+  int y;
+};
+extern std::vector<MouseSample> mouse_samples;
 void createWindow(int w, int h, const char* name);
 int getTick();
+// Frames are only drawn on request, the game asks for one whenever its output changed.
+// full also drops whatever the game cached from earlier frames.
+void requestRedraw(bool full = false);
+// Called by gameLoop before drawing, false when nothing requested a redraw since the last frame.
+bool beginFrame();
+// Whether the current frame was requested with full.
+bool isFullRedraw();
+// Frame time and input to photon latency of the presented frames, in ms. Latency runs
+// from the oldest input event of a frame until its buffer swap returned.
+void reportFrameStats(std::ostream& os);
 
 // Imports - to bo impelemnnted by game
 void gameInit();
 bool gameLoop();
+// Called every UPDATE_STEP ms of active time, independent of how often frames are drawn.
+void gameUpdate();
 void gameCleanup();
 void mouse_button(bool pressed, int button, int x, int y );
 void mouse_wheel(int value);
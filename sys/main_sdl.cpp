@@ -5,15 +5,30 @@
 #include <sstream>
 
 #include "main.h"
+#include "jobs.h"
 #include <SDL2/SDL.h>
 
 SDL_GameController *controller = NULL;
 bool processFrame();
+bool frameDrawn();
+void noteInput(int timestamp);
+void framePresented(int start, int end);
+void queueMouseMotion(int x, int y);
+void flushMouseMotion();
+
+// Events counted for the input latency statistics.
+bool isInputEvent(Uint32 type) {
+  return type == SDL_KEYDOWN || type == SDL_KEYUP || type == SDL_MOUSEMOTION
+    || type == SDL_MOUSEBUTTONDOWN || type == SDL_MOUSEBUTTONUP || type == SDL_MOUSEWHEEL;
+}
 
 bool keys[SDL_NUM_SCANCODES];
 bool processInput() {
   SDL_Event event;
   while (SDL_PollEvent(&event)) {
+    if (isInputEvent(event.type)) {
+      noteInput(event.common.timestamp);
+    }
     switch(event.type) {
       case SDL_QUIT: {
         return false;
@@ -32,9 +47,7 @@ bool processInput() {
         break;
       }
       case SDL_MOUSEMOTION: {
-        mouse_x = event.motion.x;
-        mouse_y = event.motion.y;
-        mouse_move(event.motion.xrel, event.motion.yrel);
+        queueMouseMotion(event.motion.x, event.motion.y);
         break;
       }
       case SDL_MOUSEWHEEL: {
@@ -42,6 +55,7 @@ bool processInput() {
         mouse_wheel(event.wheel.y);
       }
       case SDL_MOUSEBUTTONDOWN: {
+        flushMouseMotion();
         if (event.button.button == 1) {
           mouse_left = true;
         }
@@ -52,6 +66,7 @@ bool processInput() {
         break;
       }
       case SDL_MOUSEBUTTONUP: {
+        flushMouseMotion();
         if (event.button.button == 1) {
           mouse_left = false;
         }
@@ -69,6 +84,19 @@ bool processInput() {
         joy_button(false, event.jbutton.button);
         break;
       }
+      case SDL_WINDOWEVENT: {
+        // the window content was lost or has to be shown again, frames are only drawn on request
+        switch (event.window.event) {
+          case SDL_WINDOWEVENT_SHOWN:
+          case SDL_WINDOWEVENT_EXPOSED:
+          case SDL_WINDOWEVENT_SIZE_CHANGED:
+          case SDL_WINDOWEVENT_MAXIMIZED:
+          case SDL_WINDOWEVENT_RESTORED:
+            requestRedraw(true);
+            break;
+        }
+        break;
+      }
       case SDL_JOYAXISMOTION: {
         if (event.jaxis.axis == 0) {
           joy_x = event.jaxis.value;
@@ -81,6 +109,7 @@ bool processInput() {
       }
     }
   }
+  flushMouseMotion();
   return true;
 }
 
@@ -132,6 +161,8 @@ void init_controller() {
 }
   
 SDL_Window* sdlWindow;
+// Whether buffer swaps wait for the display, frames are paced by the swap then.
+bool vsync = false;
 
 void createWindow(int w, int h, const char* name) {
   screen_w = w;
@@ -157,6 +188,16 @@ void createWindow(int w, int h, const char* name) {
       std::cout << "Error creating context: " << SDL_GetError() << std::endl;
     }
   }
+  // adaptive sync swaps late frames right away instead of waiting for the next refresh
+  if (SDL_GL_SetSwapInterval(-1) == 0) {
+    vsync = true;
+    std::cout << "Using adaptive vsync" << std::endl;
+  } else if (SDL_GL_SetSwapInterval(1) == 0) {
+    vsync = true;
+    std::cout << "Using vsync" << std::endl;
+  } else {
+    std::cout << "No vsync, pacing frames with delays: " << SDL_GetError() << std::endl;
+  }
   init_controller();
 }
 
@@ -172,17 +213,31 @@ void swapBuffers() {
   SDL_GL_SwapWindow(sdlWindow);
 }
 
+// Longest wait for input when idle, bounds how late work queued outside of events shows up.
+const int IDLE_TIMEOUT = 250;
+// Frame length without vsync, and the longest wait for input while loads are running.
+const int FRAME_TIME = 16;
+
+// Frames are drawn only when the game requested one. Without one the loop blocks until
+// the next event, so an idle editor takes no CPU or GPU time.
 void startMainLoop() {
   while (true) {
     int beforeFrame = getTick();
     if (!processFrame()) {
       break;
     }
-    swapBuffers();
-    int afterFrame = getTick();
-    int elapsed = afterFrame - beforeFrame;
-    if (elapsed < 16) {
-        delay(16 - elapsed);
+    if (frameDrawn()) {
+      swapBuffers();
+      int afterFrame = getTick();
+      framePresented(beforeFrame, afterFrame);
+      int elapsed = afterFrame - beforeFrame;
+      if (!vsync && elapsed < FRAME_TIME) {
+        delay(FRAME_TIME - elapsed);
+      }
+    } else {
+      // loads finish without an event, check on them once per frame. The event that ends
+      // the wait stays queued, window events among them request their redraw in processInput.
+      SDL_WaitEventTimeout(nullptr, pendingJobs() > 0 ? FRAME_TIME : IDLE_TIMEOUT);
     }
   }
 }
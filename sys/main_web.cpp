@@ -11,9 +11,19 @@
 #include <emscripten/key_codes.h>
 
 bool processFrame();
+void queueMouseMotion(int x, int y);
+void flushMouseMotion();
+bool frameDrawn();
+void noteInput(int timestamp);
+void framePresented(int start, int end);
+
+int getTick() {
+  return (int)emscripten_get_now();
+}
 
 EM_BOOL key_callback(int eventType, const EmscriptenKeyboardEvent *e, void *userData) {
   //printf("key '%s', code '%s', charCode %lu, keyCode %lu\n", e->key, e->code, e->charCode, e->keyCode);
+  noteInput(getTick());
   bool pressed = true;
   if (eventType == EMSCRIPTEN_EVENT_KEYUP) {
     pressed = false;
@@ -42,20 +52,24 @@ int mapMouseButton(int jsButton) {
 }
 
 EM_BOOL mousedown_callback(int eventType, const EmscriptenMouseEvent *mouseEvent, void *userData) {
+  noteInput(getTick());
   int button = mapMouseButton(mouseEvent->button);
+  flushMouseMotion();
   mouse_button(true, button, mouseEvent->canvasX, mouseEvent->canvasY);
   return true;
 }
 
 EM_BOOL mouseup_callback(int eventType, const EmscriptenMouseEvent *mouseEvent, void *userData) {
+  noteInput(getTick());
   int button = mapMouseButton(mouseEvent->button);
+  flushMouseMotion();
   mouse_button(false, button, mouseEvent->canvasX, mouseEvent->canvasY);
   return true;
 }
 
 EM_BOOL mouse_callback(int eventType, const EmscriptenMouseEvent *mouseEvent, void *userData) {
-  mouse_x = mouseEvent->canvasX;
-  mouse_y = mouseEvent->canvasY;
+  noteInput(getTick());
+  queueMouseMotion(mouseEvent->canvasX, mouseEvent->canvasY);
   return true;
 }
 
@@ -83,13 +97,20 @@ void createWindow(int w, int h, const char* name) {
   emscripten_set_mouseup_callback(0, 0, 1, mouseup_callback);
 }
 
+// The browser presents the canvas after the callback returns, so the frame time
+// measured here leaves out compositing.
 void void_processFrame() {
+  int beforeFrame = getTick();
   processFrame();
+  if (frameDrawn()) {
+    framePresented(beforeFrame, getTick());
+  }
 }
 void startMainLoop() {
   emscripten_set_main_loop(void_processFrame, 0, true);
 }
 bool processInput() {
+  flushMouseMotion();
   return true;
 }
 
@@ -0,0 +1,18 @@
+#pragma once
+#include <algorithm>
+#include <functional>
+#include <thread>
+
+inline int workerCount() {
+#ifdef __EMSCRIPTEN__
+  // built without pthreads, everything runs on the main thread
+  return 1;
+#else
+  return std::max(1u, std::thread::hardware_concurrency());
+#endif
+}
+
+// Splits [0, count) into one contiguous band per worker and runs body(begin, end)
+// for each of them on the job pool and the calling thread, returning when all bands
+// are done. Safe to call from inside a job. Implemented in jobs.cpp.
+void parallelBands(int count, const std::function<void(int, int)>& body, int minBand = 64);